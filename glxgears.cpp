@@ -27,10 +27,29 @@
  */
 
 #include <vector>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <condition_variable>
+#include <atomic>
+#include <mutex>
 #include <math.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/timerfd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #include <glew.h>
@@ -41,6 +60,8 @@
 #include <GL/gl.h>
 #include <GL/glx.h>
 #include <GL/glxext.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #ifndef GLX_MESA_swap_control
 #define GLX_MESA_swap_control 1
@@ -54,21 +75,25 @@ typedef int (*PFNGLXGETSWAPINTERVALMESAPROC)(void);
 
 /* XXX this probably isn't very portable */
 
-#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
-/* return current time (in seconds) */
+/* return current time (in seconds) on the monotonic clock */
 static double
 current_time(void)
 {
-   struct timeval tv;
-#ifdef __VMS
-   (void) gettimeofday(&tv, NULL );
-#else
-   struct timezone tz;
-   (void) gettimeofday(&tv, &tz);
-#endif
-   return (double) tv.tv_sec + tv.tv_usec / 1000000.0;
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* return CPU time (in seconds) used by the calling thread */
+static double
+thread_cpu_time(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return (double) ts.tv_sec + ts.tv_nsec / 1000000000.0;
 }
 
 #else /*BENCHMARK*/
@@ -87,6 +112,12 @@ current_time(void)
    return t += 1.0;
 }
 
+static double
+thread_cpu_time(void)
+{
+   return 0.0;
+}
+
 #endif /*BENCHMARK*/
 
 
@@ -96,50 +127,259 @@ current_time(void)
 #endif
 
 
+/*
+ * Startup profile (-startup-profile).  startup_mark() closes the phase
+ * that ran since the previous mark; phases marked more than once (one
+ * per window, say) add up.  Only the first window's thread records.
+ */
+struct startup_phase {
+   const char *name;
+   double seconds;
+};
+
+static std::vector<startup_phase> startup_phases;
+static double startup_last;
+
+static void startup_mark(const char *name);
+
+/* Seconds since the process started, from /proc (clock tick resolution). */
+static double
+process_age(void)
+{
+   char buf[1024];
+   FILE *f = fopen("/proc/self/stat", "r");
+   if (!f)
+      return 0.0;
+   size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+   fclose(f);
+   buf[len] = '\0';
+
+   /* starttime is field 22, the 20th after the parenthesized comm */
+   const char *p = strrchr(buf, ')');
+   for (int field = 2; p && field < 22; field++)
+      p = strchr(p + 1, ' ');
+   if (!p)
+      return 0.0;
+   double start = strtoull(p + 1, NULL, 10) / (double) sysconf(_SC_CLK_TCK);
+
+   struct timespec ts;
+   clock_gettime(CLOCK_BOOTTIME, &ts);
+   double age = ts.tv_sec + ts.tv_nsec / 1000000000.0 - start;
+   return age > 0.0 ? age : 0.0;
+}
+
+static void
+start_startup_profile(void)
+{
+   double age = process_age();
+   startup_last = current_time() - age;
+   startup_mark("exec to main");
+}
+
+static void
+print_startup_profile(void)
+{
+   double total = 0.0;
+   for (const startup_phase &phase : startup_phases)
+      total += phase.seconds;
+
+   printf("startup profile:\n");
+   for (const startup_phase &phase : startup_phases)
+      printf("  %-24s %8.3f ms %5.1f%%\n", phase.name, phase.seconds * 1000.0,
+             total > 0.0 ? 100.0 * phase.seconds / total : 0.0);
+   printf("  %-24s %8.3f ms\n", "total", total * 1000.0);
+   fflush(stdout);
+}
+
+
 /** Event handler results: */
 #define NOP 0
 #define EXIT 1
 #define DRAW 2
 
-static GLfloat view_rotx = 20.0, view_roty = 30.0, view_rotz = 0.0;
-static std::pair<GLuint, GLuint> gear1, gear2, gear3;
-static GLfloat angle = 0.0;
+struct gear_mesh {
+   GLint teeth;
+   GLint lod;                           /* 0: full detail */
+   GLint index;                         /* in the arena; coarser LODs follow */
+   GLfloat radius;                      /* bounding radius around the axle */
+   GLfloat bound;                       /* bounding sphere radius */
+   GLsizei vertex_count;
+   GLsizei count;                       /* number of indices */
+   GLuint first_index;                  /* into the arena index buffer */
+   GLint base_vertex;                   /* into the arena vertex buffer */
+   GLfloat color[3];
+   GLfloat shape[4];                    /* inner/outer radius, width, tooth depth */
+};
+
+/*
+ * With -windows N every window has its own render thread and context, so
+ * the view, animation and per-context GL state below are thread_local.
+ * Geometry and programs are shared between the contexts.
+ */
+static thread_local GLfloat view_rotx = 20.0, view_roty = 30.0, view_rotz = 0.0;
+static gear_mesh gear1, gear2, gear3;
+static thread_local GLfloat angle = 0.0;
 
 static GLboolean fullscreen = GL_FALSE; /* Create a single fullscreen window */
 static GLboolean stereo = GL_FALSE;     /* Enable stereo.  */
+static GLboolean two_pass_stereo = GL_FALSE; /* -twopass: draw each eye on its own */
+static GLint pass_eyes = 1;             /* eyes per draw pass, 2 with single-pass stereo */
 static GLint samples = 0;               /* Choose visual with at least N samples. */
-static GLboolean animate = GL_TRUE;     /* Animation */
+static thread_local GLboolean animate = GL_TRUE; /* Animation */
 static GLfloat eyesep = 5.0;            /* Eye separation. */
 static GLfloat fix_point = 40.0;        /* Fixation point distance.  */
-static GLfloat left, right, asp;        /* Stereo frustum params.  */
+static thread_local GLfloat left, right, asp; /* Stereo frustum params.  */
+static GLboolean packed = GL_FALSE;     /* Use the packed vertex layout. */
+static GLboolean printInfo = GL_FALSE;  /* Print renderer and mesh info. */
+static GLint field_gears = 0;           /* Gears in the instanced gear field. */
+static GLboolean indirect = GL_TRUE;    /* Submit with glMultiDrawElementsIndirect. */
+static GLboolean gpu_cull = GL_FALSE;   /* Cull the field in a compute shader. */
+static GLboolean procedural = GL_FALSE; /* Build gear vertices from gl_VertexID. */
+static GLboolean offscreen = GL_FALSE;  /* Render into an FBO without a window. */
+static double run_seconds = 0.0;        /* Stop after this long, if non-zero. */
+static int max_frames = 0;              /* Stop after this many frames, if non-zero. */
+static GLboolean fixed_step = GL_FALSE; /* Advance angle per frame, not per second. */
+static const char *golden_dir = NULL;   /* Golden images to compare against. */
+static GLboolean golden_record = GL_FALSE; /* -golden-record: write them instead */
+static GLfloat min_psnr = 40.0;         /* Lowest PSNR that still passes. */
+static thread_local int frames_drawn = 0; /* Frames drawn so far. */
+static thread_local int win_width, win_height; /* Current viewport size. */
+static thread_local GLfloat render_scale = 1.0f; /* of the viewport, with -dynres */
+static int num_windows = 1;             /* -windows: render threads and contexts */
+static thread_local int window_index = 0; /* of the calling render thread */
+static std::atomic<bool> quit(false);   /* Escape in any window ends all of them */
+static const char *report_file = NULL;  /* -report: JSON, or CSV if *.csv */
+static int swap_interval = -1;          /* As found by query_vsync(), -1 if unknown. */
+static int frames_in_flight = 0;        /* Frames queued before waiting, 0: driver decides. */
+static int target_fps = 0;              /* -fps: draw on a timer at this rate */
+static const char *cache_dir = NULL;    /* default: $XDG_CACHE_HOME/glxgears */
+static GLboolean program_cache = GL_TRUE; /* Keep linked program binaries on disk. */
+static GLboolean mesh_cache = GL_TRUE;  /* Keep generated gear meshes on disk. */
+static GLboolean startup_profile = GL_FALSE; /* Time each startup phase. */
 
 static GLuint shaderProgram = 0;        /* Shader program */
+static GLuint indirectProgram = 0;      /* Shader program reading gl_DrawIDARB */
+static GLint mLocation = -1;            /* Uniform locations of shaderProgram */
+static GLint colorLocation = -1;
+static GLint shapeLocation = -1;        /* and of its -procedural variant */
+static GLint teethLocation = -1;
 
 static GLfloat degrees_per_rad = 57.2958;
 
+static void
+startup_mark(const char *name)
+{
+   if (!startup_profile || window_index != 0)
+      return;
+
+   double t = current_time();
+   for (startup_phase &phase : startup_phases) {
+      if (strcmp(phase.name, name) == 0) {
+         phase.seconds += t - startup_last;
+         startup_last = t;
+         return;
+      }
+   }
+   startup_phase phase = { name, t - startup_last };
+   startup_phases.push_back(phase);
+   startup_last = t;
+}
+
 struct vertex {
   GLfloat position[3];
   GLfloat normal[3];
-  GLfloat color[3];
+};
+
+/* Compact layout: full precision position, 10:10:10:2 normal. */
+struct packed_vertex {
+  GLfloat position[3];
+  GLuint normal;
+};
+
+/* Layout the gears used before indexing: position, normal and color. */
+static const size_t unindexed_vertex_size = 9 * sizeof(GLfloat);
+static const size_t unindexed_vertices_per_tooth = 66;
+
+static GLuint
+pack_normal(const GLfloat n[3])
+{
+   GLuint packed = 0;
+   for (int i = 0; i < 3; i++) {
+      GLint c = (GLint) lrintf(fminf(fmaxf(n[i], -1.0f), 1.0f) * 511.0f);
+      packed |= ((GLuint) c & 0x3ff) << (10 * i);
+   }
+   return packed;
+}
+
+struct gear_shape {
+   GLfloat inner_radius;                /* radius of hole at center */
+   GLfloat outer_radius;                /* radius at center of teeth */
+   GLfloat width;                       /* width of gear */
+   GLint teeth;                         /* number of teeth */
+   GLfloat tooth_depth;                 /* depth of tooth */
+};
+
+/* Indexed triangle list on the CPU, ready for upload. */
+struct mesh_data {
+   std::vector<vertex> vertices;
+   std::vector<GLuint> indices;
 };
 
 /*
- *
- *  Draw a gear wheel.  You'll probably want to call this function when
- *  building a display list since we do a lot of trig here.
- * 
- *  Input:  inner_radius - radius of hole at center
- *          outer_radius - radius at center of teeth
- *          width - width of gear
- *          teeth - number of teeth
- *          tooth_depth - depth of tooth
+ * Collects triangles and welds vertices with identical position and normal
+ * into a single index.  Degenerate triangles are dropped.
  */
-static std::pair<GLuint, GLuint> gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
-     GLint teeth, GLfloat tooth_depth, GLfloat red, GLfloat green, GLfloat blue)
+struct mesh_builder : mesh_data {
+   struct vertex_hash {
+      size_t operator()(const vertex &v) const {
+         size_t h = 0;
+         for (GLfloat f : v.position)
+            h = h * 31 + std::hash<GLfloat>()(f);
+         for (GLfloat f : v.normal)
+            h = h * 31 + std::hash<GLfloat>()(f);
+         return h;
+      }
+   };
+   struct vertex_equal {
+      bool operator()(const vertex &a, const vertex &b) const {
+         return memcmp(&a, &b, sizeof(vertex)) == 0;
+      }
+   };
+
+   std::unordered_map<vertex, GLuint, vertex_hash, vertex_equal> lookup;
+   GLuint triangle[3];
+   int corner = 0;
+
+   void add(const vertex &v)
+   {
+      auto it = lookup.find(v);
+      if (it == lookup.end()) {
+         it = lookup.emplace(v, (GLuint) vertices.size()).first;
+         vertices.push_back(v);
+      }
+      triangle[corner++] = it->second;
+      if (corner == 3) {
+         corner = 0;
+         if (triangle[0] != triangle[1] && triangle[1] != triangle[2] &&
+             triangle[0] != triangle[2])
+            indices.insert(indices.end(), triangle, triangle + 3);
+      }
+   }
+};
+
+/*
+ * Original triangle-by-triangle gear generator.  It does a lot of trig and
+ * relies on mesh_builder to find the shared vertices, so it is only kept as
+ * the reference for -genbench.
+ */
+static void
+generate_gear_reference(const gear_shape &shape, mesh_builder &mesh)
 {
+   GLfloat inner_radius = shape.inner_radius, outer_radius = shape.outer_radius;
+   GLfloat width = shape.width, tooth_depth = shape.tooth_depth;
+   GLint teeth = shape.teeth;
    GLfloat r0 = inner_radius, r1 = outer_radius - tooth_depth / 2.0, r2 = outer_radius + tooth_depth / 2.0;
    GLfloat da = 2.0 * M_PI / teeth / 4.0;
-   std::vector<vertex> buffer;
 
    for (size_t i = 0; i < (size_t)teeth; i++) {
       GLfloat angle = i * 2.0 * M_PI / teeth;
@@ -157,311 +397,4260 @@ static std::pair<GLuint, GLuint> gear(GLfloat inner_radius, GLfloat outer_radius
       v2 /= len2;
 
       /* draw front face */
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle), r1 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle2), r1 * sin(angle2), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle2), r1 * sin(angle2), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle2), r0 * sin(angle2), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r1 * cos(angle), r1 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0 });
+
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r1 * cos(angle2), r1 * sin(angle2), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r1 * cos(angle2), r1 * sin(angle2), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r0 * cos(angle2), r0 * sin(angle2), width * 0.5f, 0.0, 0.0, 1.0 });
 
       /* draw front sides of teeth */
-      buffer.push_back({ r1 * cos(angle), r1 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle), r1 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, 0.0, 0.0, 1.0, red, green, blue });
+      mesh.add({ r1 * cos(angle), r1 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r1 * cos(angle), r1 * sin(angle), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f, 0.0, 0.0, 1.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, 0.0, 0.0, 1.0 });
 
       /* draw back face */
-      buffer.push_back({ r1 * cos(angle), r1 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle), r1 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle2), r0 * sin(angle2), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle2), r0 * sin(angle2), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle2), r1 * sin(angle2), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
+      mesh.add({ r1 * cos(angle), r1 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r1 * cos(angle), r1 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, 0.0, 0.0, -1.0 });
+
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r0 * cos(angle2), r0 * sin(angle2), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r0 * cos(angle2), r0 * sin(angle2), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r1 * cos(angle2), r1 * sin(angle2), -width * 0.5f, 0.0, 0.0, -1.0 });
 
       /* draw back sides of teeth */
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle), r1 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0, red, green, blue });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f, 0.0, 0.0, -1.0 });
+      mesh.add({ r1 * cos(angle), r1 * sin(angle), -width * 0.5f, 0.0, 0.0, -1.0 });
 
       /* draw outward faces of teeth */
-      buffer.push_back({ r1 * cos(angle), r1 * sin(angle), width * 0.5f, v, -u, 0.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle), r1 * sin(angle), -width * 0.5f, v, -u, 0.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f, v, -u, 0.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle), r1 * sin(angle), width * 0.5f, v, -u, 0.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f, v, -u, 0.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5f, v, -u, 0.0, red, green, blue });
-
-      buffer.push_back({ r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5f, cos(angle), sin(angle), 0.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f, cos(angle), sin(angle), 0.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), -width * 0.5f, cos(angle), sin(angle), 0.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5f, cos(angle), sin(angle), 0.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), -width * 0.5f, cos(angle), sin(angle), 0.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f, cos(angle), sin(angle), 0.0, red, green, blue });
-
-      buffer.push_back({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f, v2, -u2, 0.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), -width * 0.5f, v2, -u2, 0.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, v2, -u2, 0.0, red, green, blue });
-      buffer.push_back({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f, v2, -u2, 0.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, v2, -u2, 0.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, v2, -u2, 0.0, red, green, blue });
-
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, cos(angle2), sin(angle2), 0.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, cos(angle2), sin(angle2), 0.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle2), r1 * sin(angle2), -width * 0.5f, cos(angle2), sin(angle2), 0.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, cos(angle2), sin(angle2), 0.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle2), r1 * sin(angle2), -width * 0.5f, cos(angle2), sin(angle2), 0.0, red, green, blue });
-      buffer.push_back({ r1 * cos(angle2), r1 * sin(angle2), width * 0.5f, cos(angle2), sin(angle2), 0.0, red, green, blue });
+      mesh.add({ r1 * cos(angle), r1 * sin(angle), width * 0.5f, v, -u, 0.0 });
+      mesh.add({ r1 * cos(angle), r1 * sin(angle), -width * 0.5f, v, -u, 0.0 });
+      mesh.add({ r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f, v, -u, 0.0 });
+      mesh.add({ r1 * cos(angle), r1 * sin(angle), width * 0.5f, v, -u, 0.0 });
+      mesh.add({ r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f, v, -u, 0.0 });
+      mesh.add({ r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5f, v, -u, 0.0 });
+
+      mesh.add({ r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5f, cos(angle), sin(angle), 0.0 });
+      mesh.add({ r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f, cos(angle), sin(angle), 0.0 });
+      mesh.add({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), -width * 0.5f, cos(angle), sin(angle), 0.0 });
+      mesh.add({ r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5f, cos(angle), sin(angle), 0.0 });
+      mesh.add({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), -width * 0.5f, cos(angle), sin(angle), 0.0 });
+      mesh.add({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f, cos(angle), sin(angle), 0.0 });
+
+      mesh.add({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f, v2, -u2, 0.0 });
+      mesh.add({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), -width * 0.5f, v2, -u2, 0.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, v2, -u2, 0.0 });
+      mesh.add({ r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f, v2, -u2, 0.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, v2, -u2, 0.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, v2, -u2, 0.0 });
+
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, cos(angle2), sin(angle2), 0.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f, cos(angle2), sin(angle2), 0.0 });
+      mesh.add({ r1 * cos(angle2), r1 * sin(angle2), -width * 0.5f, cos(angle2), sin(angle2), 0.0 });
+      mesh.add({ r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f, cos(angle2), sin(angle2), 0.0 });
+      mesh.add({ r1 * cos(angle2), r1 * sin(angle2), -width * 0.5f, cos(angle2), sin(angle2), 0.0 });
+      mesh.add({ r1 * cos(angle2), r1 * sin(angle2), width * 0.5f, cos(angle2), sin(angle2), 0.0 });
 
       /* draw inside radius cylinder */
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, -cos(angle), -sin(angle), 0.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, -cos(angle), -sin(angle), 0.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle2), r0 * sin(angle2), width * 0.5f, -cos(angle2), -sin(angle2), 0.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, -cos(angle), -sin(angle), 0.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle2), r0 * sin(angle2), width * 0.5f, -cos(angle2), -sin(angle2), 0.0, red, green, blue });
-      buffer.push_back({ r0 * cos(angle2), r0 * sin(angle2), -width * 0.5f, -cos(angle2), -sin(angle2), 0.0, red, green, blue });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, -cos(angle), -sin(angle), 0.0 });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), width * 0.5f, -cos(angle), -sin(angle), 0.0 });
+      mesh.add({ r0 * cos(angle2), r0 * sin(angle2), width * 0.5f, -cos(angle2), -sin(angle2), 0.0 });
+      mesh.add({ r0 * cos(angle), r0 * sin(angle), -width * 0.5f, -cos(angle), -sin(angle), 0.0 });
+      mesh.add({ r0 * cos(angle2), r0 * sin(angle2), width * 0.5f, -cos(angle2), -sin(angle2), 0.0 });
+      mesh.add({ r0 * cos(angle2), r0 * sin(angle2), -width * 0.5f, -cos(angle2), -sin(angle2), 0.0 });
    }
+}
 
-   GLuint vao;
-   glGenVertexArrays(1, &vao);
-   glBindVertexArray(vao);   
+/*
+ * Vertex slots of one tooth in the welded mesh, matching the triangles of
+ * generate_gear_reference():
+ *
+ *    0- 4  front face: r0 a0, r1 a0, r1 a3, r2 a1, r2 a2
+ *    5- 9  back face, same positions
+ *   10-25  outward faces of teeth, four quads with their own normal
+ *   26-27  inside radius cylinder at a0, back and front
+ *
+ * where a0..a3 are the quarter steps of the tooth.  Triangles that close a
+ * tooth against its neighbour refer to the next tooth's slots (NEXT + slot).
+ */
+static const int tooth_vertices = 28;
+static const int tooth_indices = 60;
+#define NEXT 32
 
-   GLuint vbo;
-   glGenBuffers(1, &vbo);
-   glBindBuffer(GL_ARRAY_BUFFER, vbo);
-   glBufferData(GL_ARRAY_BUFFER, sizeof(vertex) * buffer.size(), buffer.data(), GL_STATIC_DRAW);
-   glEnableVertexAttribArray(0);
-   glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)0);
-   glEnableVertexAttribArray(1);
-   glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)12);
-   glEnableVertexAttribArray(2);
-   glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)24);
+static const unsigned char tooth_triangles[tooth_indices] = {
+   /* front face */
+   0, 1, 2,  0, 2, NEXT + 1,  0, NEXT + 1, NEXT + 0,
+   /* front sides of teeth */
+   1, 3, 4,  1, 4, 2,
+   /* back face */
+   6, 5, 7,  7, 5, NEXT + 5,  7, NEXT + 5, NEXT + 6,
+   /* back sides of teeth */
+   7, 9, 8,  7, 8, 6,
+   /* outward faces of teeth */
+   10, 11, 12,  10, 12, 13,
+   14, 15, 16,  14, 16, 17,
+   18, 19, 20,  18, 20, 21,
+   22, 23, 24,  22, 24, 25,
+   /* inside radius cylinder */
+   26, 27, NEXT + 27,  26, NEXT + 27, NEXT + 26,
+};
 
-   return {vao, vbo};
+/*
+ * Vertices are stored in blocks of four teeth, slot-major within a block,
+ * so the SSE path can write four teeth of one slot with contiguous stores.
+ * The last block is narrower when teeth is not a multiple of four.
+ */
+static inline GLuint
+tooth_vertex_index(GLint teeth, GLint tooth, GLint slot)
+{
+   GLint base = tooth & ~3;
+   GLint w = teeth - base < 4 ? teeth - base : 4;
+   return base * tooth_vertices + slot * w + (tooth & 3);
 }
 
-static void draw(glm::mat4 view_projection)
+/*
+ * Emit the 28 vertices of a tooth (or of four teeth at once when F is a
+ * vector type) from the cos/sin of its five quarter step angles.
+ */
+template <typename F, typename Store>
+static inline void
+gear_tooth(F r0, F r1, F r2, F hw, const F c[5], const F s[5], Store store)
 {
-   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+   const F zero(0.0f), one(1.0f);
 
-   view_projection = glm::rotate(view_projection, view_rotx / degrees_per_rad, glm::vec3(1.0, 0.0, 0.0));
-   view_projection = glm::rotate(view_projection, view_roty / degrees_per_rad, glm::vec3(0.0, 1.0, 0.0));
-   view_projection = glm::rotate(view_projection, view_rotz / degrees_per_rad, glm::vec3(0.0, 0.0, 1.0));
-   glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "vp"), 1, false, glm::value_ptr(view_projection));
+   F u = r2 * c[1] - r1 * c[0];
+   F v = r2 * s[1] - r1 * s[0];
+   F len = one / sqrt(u * u + v * v);
+   F nx1 = v * len, ny1 = zero - u * len;
+   F u2 = r1 * c[3] - r2 * c[2];
+   F v2 = r1 * s[3] - r2 * s[2];
+   F len2 = one / sqrt(u2 * u2 + v2 * v2);
+   F nx3 = v2 * len2, ny3 = zero - u2 * len2;
 
-   glm::mat4 gear1_m = glm::rotate(glm::translate(glm::mat4(1.0f), glm::vec3(-3.0, -2.0, 0.0)), angle / degrees_per_rad, glm::vec3(0.0, 0.0, 1.0));
-   glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "m"), 1, false, glm::value_ptr(gear1_m));
-   glBindVertexArray(gear1.first);
-   glDrawArrays(GL_TRIANGLES, 0, 1320);
+   F x0 = r0 * c[0], y0 = r0 * s[0];
+   F x1 = r1 * c[0], y1 = r1 * s[0];
+   F x2 = r2 * c[1], y2 = r2 * s[1];
+   F x3 = r2 * c[2], y3 = r2 * s[2];
+   F x4 = r1 * c[3], y4 = r1 * s[3];
+   F x5 = r1 * c[4], y5 = r1 * s[4];
+   F nhw = zero - hw, minus_one = zero - one;
 
-   glm::mat4 gear2_m = glm::rotate(glm::translate(glm::mat4(1.0f), glm::vec3(3.1, -2.0, 0.0)), (-2.0f * angle - 9.0f) / degrees_per_rad, glm::vec3(0.0, 0.0, 1.0));
-   glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "m"), 1, false, glm::value_ptr(gear2_m));
-   glBindVertexArray(gear2.first);
-   glDrawArrays(GL_TRIANGLES, 0, 660);
+   store(0, x0, y0, hw, zero, zero, one);
+   store(1, x1, y1, hw, zero, zero, one);
+   store(2, x4, y4, hw, zero, zero, one);
+   store(3, x2, y2, hw, zero, zero, one);
+   store(4, x3, y3, hw, zero, zero, one);
 
-   glm::mat4 gear3_m = glm::rotate(glm::translate(glm::mat4(1.0f), glm::vec3(-3.1, 4.2, 0.0)), (-2.0f * angle - 25.0f) / degrees_per_rad, glm::vec3(0.0, 0.0, 1.0));
-   glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "m"), 1, false, glm::value_ptr(gear3_m));
-   glBindVertexArray(gear3.first);
-   glDrawArrays(GL_TRIANGLES, 0, 660);
-}
+   store(5, x0, y0, nhw, zero, zero, minus_one);
+   store(6, x1, y1, nhw, zero, zero, minus_one);
+   store(7, x4, y4, nhw, zero, zero, minus_one);
+   store(8, x2, y2, nhw, zero, zero, minus_one);
+   store(9, x3, y3, nhw, zero, zero, minus_one);
 
-static void
-draw_gears(void)
-{
-   if (stereo) {
-      /* First left eye.  */
-      glDrawBuffer(GL_BACK_LEFT);
-      glm::mat4 view_projection_left = glm::translate(glm::frustum(left, right, -asp, asp, 5.0f, 60.0f), glm::vec3(0.5 * eyesep, 0.0, -40.0));
-      draw(view_projection_left);
+   store(10, x1, y1, hw, nx1, ny1, zero);
+   store(11, x1, y1, nhw, nx1, ny1, zero);
+   store(12, x2, y2, nhw, nx1, ny1, zero);
+   store(13, x2, y2, hw, nx1, ny1, zero);
 
-      /* Then right eye.  */
-      glDrawBuffer(GL_BACK_RIGHT);
-      glm::mat4 view_projection_right = glm::translate(glm::frustum(-right, -left, -asp, asp, 5.0f, 60.0f), glm::vec3(-0.5 * eyesep, 0.0, -40.0));
-      draw(view_projection_right);
-   }
-   else {
-      glm::mat4 view_projection = glm::translate(glm::frustum(-1.0f, 1.0f, -asp, asp, 5.0f, 60.0f), glm::vec3(0.0, 0.0, -40.0));
-      draw(view_projection);
-   }
+   store(14, x2, y2, hw, c[0], s[0], zero);
+   store(15, x2, y2, nhw, c[0], s[0], zero);
+   store(16, x3, y3, nhw, c[0], s[0], zero);
+   store(17, x3, y3, hw, c[0], s[0], zero);
+
+   store(18, x3, y3, hw, nx3, ny3, zero);
+   store(19, x3, y3, nhw, nx3, ny3, zero);
+   store(20, x4, y4, nhw, nx3, ny3, zero);
+   store(21, x4, y4, hw, nx3, ny3, zero);
+
+   store(22, x4, y4, hw, c[4], s[4], zero);
+   store(23, x4, y4, nhw, c[4], s[4], zero);
+   store(24, x5, y5, nhw, c[4], s[4], zero);
+   store(25, x5, y5, hw, c[4], s[4], zero);
+
+   store(26, x0, y0, nhw, zero - c[0], zero - s[0], zero);
+   store(27, x0, y0, hw, zero - c[0], zero - s[0], zero);
 }
 
+#ifdef __SSE2__
+/* Just enough of a float4 type to run gear_tooth() on four teeth. */
+struct f4 {
+   __m128 v;
+   f4(__m128 v) : v(v) {}
+   explicit f4(float f) : v(_mm_set1_ps(f)) {}
+};
 
-/** Draw single frame, do SwapBuffers, compute FPS */
-static void
-draw_frame(Display *dpy, Window win)
+static inline f4 operator+(f4 a, f4 b) { return _mm_add_ps(a.v, b.v); }
+static inline f4 operator-(f4 a, f4 b) { return _mm_sub_ps(a.v, b.v); }
+static inline f4 operator*(f4 a, f4 b) { return _mm_mul_ps(a.v, b.v); }
+static inline f4 operator/(f4 a, f4 b) { return _mm_div_ps(a.v, b.v); }
+static inline f4 sqrt(f4 a) { return _mm_sqrt_ps(a.v); }
+
+/* Transpose one slot of four teeth into four consecutive vertices. */
+static inline void
+store4(vertex *dst, f4 x, f4 y, f4 z, f4 nx, f4 ny, f4 nz)
 {
-   static int frames = 0;
-   static double tRot0 = -1.0, tRate0 = -1.0;
-   double dt, t = current_time();
+   __m128 r0 = x.v, r1 = y.v, r2 = z.v, r3 = nx.v;
+   _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+   __m128 lo = _mm_unpacklo_ps(ny.v, nz.v);
+   __m128 hi = _mm_unpackhi_ps(ny.v, nz.v);
+   float *out = dst->position;
+   _mm_storeu_ps(out + 0, r0);
+   _mm_storeu_ps(out + 4, _mm_movelh_ps(lo, r1));
+   _mm_storeu_ps(out + 8, _mm_shuffle_ps(r1, lo, _MM_SHUFFLE(3, 2, 3, 2)));
+   _mm_storeu_ps(out + 12, r2);
+   _mm_storeu_ps(out + 16, _mm_movelh_ps(hi, r3));
+   _mm_storeu_ps(out + 20, _mm_shuffle_ps(r3, hi, _MM_SHUFFLE(3, 2, 3, 2)));
+}
+#endif
 
-   if (tRot0 < 0.0)
-      tRot0 = t;
-   dt = t - tRot0;
-   tRot0 = t;
+/*
+ * Build teeth [first, last) of the welded gear mesh directly into mesh,
+ * which is already sized for all teeth.  first is a multiple of four, so
+ * ranges write disjoint blocks and can be built in parallel.  The sin/cos
+ * of every quarter tooth step is computed once by rotation from the
+ * range's first angle, and the vertices are written four teeth at a time
+ * with SSE where available.
+ */
+static void
+generate_gear_teeth(const gear_shape &shape, GLint first, GLint last, mesh_data &mesh)
+{
+   const GLint teeth = shape.teeth;
+   const GLfloat r0 = shape.inner_radius;
+   const GLfloat r1 = shape.outer_radius - shape.tooth_depth / 2.0;
+   const GLfloat r2 = shape.outer_radius + shape.tooth_depth / 2.0;
+   const GLfloat hw = shape.width * 0.5f;
+   const GLint n = last - first;
 
-   if (animate) {
-      /* advance rotation for next frame */
-      angle += 70.0 * dt;  /* 70 degrees per second */
-      if (angle > 3600.0)
-         angle -= 3600.0;
+   /* cos/sin of quarter step k of tooth first + t at [k * stride + t],
+    * padded so that four teeth can always be loaded from t + 1. */
+   const GLint stride = n + 4;
+   std::vector<GLfloat> table(8 * stride);
+   GLfloat *cos_table = table.data(), *sin_table = cos_table + 4 * stride;
+   const double da = 2.0 * M_PI / teeth / 4.0;
+   const double cd = cos(da), sd = sin(da);
+   double c = first ? cos(4 * first * da) : 1.0, s = first ? sin(4 * first * da) : 0.0;
+   for (GLint j = 0; j <= 4 * n; j++) {
+      cos_table[(j & 3) * stride + (j >> 2)] = c;
+      sin_table[(j & 3) * stride + (j >> 2)] = s;
+      double cn = c * cd - s * sd;
+      s = s * cd + c * sd;
+      c = cn;
+   }
+   /* The last tooth closes exactly onto the first one. */
+   if (last == teeth) {
+      cos_table[n] = 1.0f;
+      sin_table[n] = 0.0f;
    }
 
-   draw_gears();
-   glXSwapBuffers(dpy, win);
+   vertex *out = mesh.vertices.data();
 
-   frames++;
-   
-   if (tRate0 < 0.0)
-      tRate0 = t;
-   if (t - tRate0 >= 5.0) {
-      GLfloat seconds = t - tRate0;
-      GLfloat fps = frames / seconds;
-      printf("%d frames in %3.1f seconds = %6.3f FPS\n", frames, seconds,
-             fps);
-      fflush(stdout);
-      tRate0 = t;
-      frames = 0;
+   GLint t = 0;
+#ifdef __SSE2__
+   for (; t + 4 <= n; t += 4) {
+      f4 c4[5] = {
+         _mm_loadu_ps(cos_table + t), _mm_loadu_ps(cos_table + stride + t),
+         _mm_loadu_ps(cos_table + 2 * stride + t), _mm_loadu_ps(cos_table + 3 * stride + t),
+         _mm_loadu_ps(cos_table + t + 1),
+      };
+      f4 s4[5] = {
+         _mm_loadu_ps(sin_table + t), _mm_loadu_ps(sin_table + stride + t),
+         _mm_loadu_ps(sin_table + 2 * stride + t), _mm_loadu_ps(sin_table + 3 * stride + t),
+         _mm_loadu_ps(sin_table + t + 1),
+      };
+      vertex *block = out + (first + t) * tooth_vertices;
+      gear_tooth(f4(r0), f4(r1), f4(r2), f4(hw), c4, s4,
+                 [block](int slot, f4 x, f4 y, f4 z, f4 nx, f4 ny, f4 nz) {
+                    store4(block + slot * 4, x, y, z, nx, ny, nz);
+                 });
+   }
+#endif
+   for (; t < n; t++) {
+      GLfloat c1[5] = { cos_table[t], cos_table[stride + t], cos_table[2 * stride + t],
+                        cos_table[3 * stride + t], cos_table[t + 1] };
+      GLfloat s1[5] = { sin_table[t], sin_table[stride + t], sin_table[2 * stride + t],
+                        sin_table[3 * stride + t], sin_table[t + 1] };
+      GLint base = (first + t) & ~3;
+      GLint w = teeth - base < 4 ? teeth - base : 4;
+      vertex *v = out + tooth_vertex_index(teeth, first + t, 0);
+      gear_tooth(r0, r1, r2, hw, c1, s1,
+                 [v, w](int slot, float x, float y, float z, float nx, float ny, float nz) {
+                    v[slot * w] = { x, y, z, nx, ny, nz };
+                 });
+   }
+
+   GLuint *index = mesh.indices.data() + (size_t) first * tooth_indices;
+   for (t = first; t < last; t++) {
+      GLint next = t + 1 == teeth ? 0 : t + 1;
+      for (int i = 0; i < tooth_indices; i++) {
+         int slot = tooth_triangles[i];
+         if (slot >= NEXT)
+            *index++ = tooth_vertex_index(teeth, next, slot - NEXT);
+         else
+            *index++ = tooth_vertex_index(teeth, t, slot);
+      }
    }
 }
 
+#undef NEXT
 
-/* new window size or exposure */
 static void
-reshape(int width, int height)
+size_gear_mesh(const gear_shape &shape, mesh_data &mesh)
 {
-   GLfloat w = fix_point * (1.0 / 5.0);
-   glViewport(0, 0, (GLint) width, (GLint) height);
+   mesh.vertices.resize((size_t) shape.teeth * tooth_vertices);
+   mesh.indices.resize((size_t) shape.teeth * tooth_indices);
+}
 
-   asp = (GLfloat) height / (GLfloat) width;
-   left = -5.0 * ((w - 0.5 * eyesep) / fix_point);
-   right = 5.0 * ((w + 0.5 * eyesep) / fix_point);
+static void
+generate_gear(const gear_shape &shape, mesh_data &mesh)
+{
+   size_gear_mesh(shape, mesh);
+   generate_gear_teeth(shape, 0, shape.teeth, mesh);
 }
-   
-static const char vertexShader[] =
-"#version 330 core\n"
-"#extension GL_ARB_separate_shader_objects : enable\n"
-"layout(location = 0) in vec3 position;\n"
-"layout(location = 1) in vec3 normal;\n"
-"layout(location = 2) in vec3 color;\n"
-"uniform mat4 m;\n"
-"uniform mat4 vp;\n"
-"layout(location = 0) out vec4 vs_position;\n"
-"layout(location = 1) out vec3 vs_normal;\n"
-"layout(location = 2) out vec3 vs_color;\n"
-"void main(){\n"
-"  vs_position = m * vec4(position, 1);\n"
-"  gl_Position = vp * vs_position;\n"
-"  vs_normal = normalize(mat3(m) * normal);\n"
-"  vs_color = color;\n"
-"}\n"
-;
 
-static const char fragmentShader[] =
-"#version 330 core\n"
-"#extension GL_ARB_separate_shader_objects : enable\n"
-"layout(location = 0) in vec4 vs_position;\n"
-"layout(location = 1) in vec3 vs_normal;\n"
-"layout(location = 2) in vec3 vs_color;\n"
-"uniform vec3 light_position;\n"
-"out vec4 color;\n"
-"void main(){\n"
-//"  vec3 light_vector = normalize(light_position - (vs_position.xyz / vs_position.w));\n" // Point light
-"  vec3 light_vector = normalize(light_position);\n" // Directional light
-"  vec3 middle = (light_vector + vs_normal) / 2;\n" // I can't recall *why* this does a thing, but this approximates OG glxgears results.
-"  float dp = dot(middle, vs_normal);\n"
-"  float v = max(dp, 0.0);\n"
-"  color = v * vec4(vs_color, 1.0);\n"
-"}\n"
-;
+/*
+ * Coarser levels of detail for gears that cover few pixels.  LOD 1 drops
+ * the teeth: a ring with one segment per tooth at the pitch radius, hole
+ * included.  LOD 2 is a solid hexagonal prism.  Faces are flat shaded
+ * like the full mesh; the outer wall is smooth.
+ */
+static const int gear_lods = 3;
 
-static void checkShaderError(GLuint shader) {
-	int InfoLogLength;  
-	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	if ( InfoLogLength > 0 ){
-		std::vector<char> VertexShaderErrorMessage(InfoLogLength+1);
-		glGetShaderInfoLog(shader, InfoLogLength, NULL, VertexShaderErrorMessage.data());
-		printf("%s\n", VertexShaderErrorMessage.data());
-	}
+static int
+lod_segments(const gear_shape &shape, int lod)
+{
+   if (lod == 1)
+      return shape.teeth > 6 ? shape.teeth : 6;
+   return 6;
 }
 
 static void
-init(void)
+lod_mesh_size(const gear_shape &shape, int lod, size_t &vertices, size_t &indices)
 {
-   glEnable(GL_CULL_FACE);
-   glEnable(GL_DEPTH_TEST);
+   if (lod == 0) {
+      vertices = (size_t) shape.teeth * tooth_vertices;
+      indices = (size_t) shape.teeth * tooth_indices;
+      return;
+   }
+   size_t n = lod_segments(shape, lod);
+   if (lod == 1) {
+      vertices = 8 * n;                 /* two rings per face, two per wall */
+      indices = 4 * 6 * n;
+   }
+   else {
+      vertices = 4 * n;                 /* one ring per face, two for the wall */
+      indices = 2 * 3 * (n - 2) + 6 * n;
+   }
+}
 
-   /* make the gears */
-   gear1 = gear(1.0, 4.0, 1.0, 20, 0.7, 0.8, 0.1, 0.0);
-   gear2 = gear(0.5, 2.0, 2.0, 10, 0.7, 0.0, 0.8, 0.2);
-   gear3 = gear(1.3, 2.0, 0.5, 10, 0.7, 0.2, 0.2, 1.0);
+static void
+generate_gear_lod(const gear_shape &shape, int lod, mesh_data &mesh)
+{
+   const int n = lod_segments(shape, lod);
+   const GLfloat r0 = lod == 1 ? shape.inner_radius : 0.0f;
+   const GLfloat r1 = shape.outer_radius;
+   const GLfloat hw = shape.width * 0.5f;
 
-   GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-   const char* fragmentShaderSource = fragmentShader;
-   glShaderSource(fs, 1, &fragmentShaderSource, NULL);
-   glCompileShader(fs);
+   mesh.vertices.clear();
+   mesh.indices.clear();
+   /* ring of n vertices at radius r and height z, facing (nr outward, nz) */
+   auto ring = [&](GLfloat r, GLfloat z, GLfloat nr, GLfloat nz) {
+      GLuint first = mesh.vertices.size();
+      for (int i = 0; i < n; i++) {
+         GLfloat a = i * 2.0 * M_PI / n;
+         vertex v = { { r * cosf(a), r * sinf(a), z },
+                      { nr * cosf(a), nr * sinf(a), nz } };
+         mesh.vertices.push_back(v);
+      }
+      return first;
+   };
+   /* quad strip between two rings, wound to face the outside */
+   auto strip = [&](GLuint a, GLuint b, bool flip) {
+      for (int i = 0; i < n; i++) {
+         GLuint i0 = a + i, i1 = a + (i + 1) % n, j0 = b + i, j1 = b + (i + 1) % n;
+         GLuint quad[6] = { i0, j0, j1, i0, j1, i1 };
+         if (flip) {
+            std::swap(quad[1], quad[2]);
+            std::swap(quad[4], quad[5]);
+         }
+         mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+      }
+   };
+   /* triangle fan over one ring */
+   auto fan = [&](GLuint a, bool flip) {
+      for (int i = 1; i + 1 < n; i++) {
+         GLuint tri[3] = { a, a + i + (flip ? 1 : 0), a + i + (flip ? 0 : 1) };
+         mesh.indices.insert(mesh.indices.end(), tri, tri + 3);
+      }
+   };
 
-   checkShaderError(fs);
+   if (lod == 1) {
+      GLuint front_in = ring(r0, hw, 0, 1), front_out = ring(r1, hw, 0, 1);
+      GLuint back_in = ring(r0, -hw, 0, -1), back_out = ring(r1, -hw, 0, -1);
+      GLuint wall_front = ring(r1, hw, 1, 0), wall_back = ring(r1, -hw, 1, 0);
+      GLuint hole_front = ring(r0, hw, -1, 0), hole_back = ring(r0, -hw, -1, 0);
+      strip(front_in, front_out, false);
+      strip(back_in, back_out, true);
+      strip(wall_front, wall_back, false);
+      strip(hole_front, hole_back, true);
+   }
+   else {
+      GLuint front = ring(r1, hw, 0, 1), back = ring(r1, -hw, 0, -1);
+      GLuint wall_front = ring(r1, hw, 1, 0), wall_back = ring(r1, -hw, 1, 0);
+      fan(front, false);
+      fan(back, true);
+      strip(wall_front, wall_back, false);
+   }
+}
 
-   const char* vertexShaderSource = vertexShader;
-   GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-   glShaderSource(vs, 1, &vertexShaderSource, NULL);
-   glCompileShader(vs);
+/*
+ * Work-stealing thread pool for CPU-side scene setup and the animation of
+ * big gear fields.  Every worker owns a deque: it takes its own tasks from
+ * the back and, once that is empty, steals from the front of the others'.
+ * run_tasks() deals a batch out round-robin, works on it from the calling
+ * thread as well and returns when every task has finished.  Tasks never
+ * call GL; whatever they produce is uploaded by the GL thread afterwards,
+ * or written to a mapped buffer it draws from.
+ */
+typedef std::function<void()> task;
 
-   checkShaderError(vs);
+struct task_queue {
+   std::mutex lock;
+   std::deque<task> tasks;
+};
 
-   shaderProgram = glCreateProgram();
-   glAttachShader(shaderProgram, vs);
-   glAttachShader(shaderProgram, fs);
-   glLinkProgram(shaderProgram);
+struct thread_pool {
+   int size;                            /* workers, counting the caller */
+   std::vector<std::unique_ptr<task_queue>> queues;
+   std::vector<std::thread> threads;
+   std::mutex lock;
+   std::condition_variable wake, done;
+   std::atomic<int> remaining;
+   int batch;                           /* bumped for every run_tasks() */
+   bool stop;
+};
 
-   glDetachShader(shaderProgram, vs);
-   glDetachShader(shaderProgram, fs);
-   glDeleteShader(vs);
-   glDeleteShader(fs);
+static thread_pool pool;
+static int pool_threads = 0;            /* -threads: pool size, 0: one per core */
 
-   glUseProgram(shaderProgram);
+static bool
+take_task(int self, task &t)
+{
+   for (int i = 0; i < pool.size; i++) {
+      task_queue &q = *pool.queues[(self + i) % pool.size];
+      std::lock_guard<std::mutex> lock(q.lock);
+      if (q.tasks.empty())
+         continue;
+      if (i == 0) {
+         t = std::move(q.tasks.back());
+         q.tasks.pop_back();
+      }
+      else {
+         t = std::move(q.tasks.front());
+         q.tasks.pop_front();
+      }
+      return true;
+   }
+   return false;
+}
 
-   static GLfloat pos[4] = { 5.0, 5.0, 10.0 };
-   glUniform3fv(glGetUniformLocation(shaderProgram, "light_position"), 1, pos);
+static void
+work_on_tasks(int self)
+{
+   task t;
+   while (take_task(self, t)) {
+      t();
+      if (--pool.remaining == 0) {
+         std::lock_guard<std::mutex> lock(pool.lock);
+         pool.done.notify_all();
+      }
+   }
 }
 
-/**
- * Remove window border/decorations.
- */
 static void
-no_border( Display *dpy, Window w)
+pool_worker(int self)
 {
-   static const unsigned MWM_HINTS_DECORATIONS = (1 << 1);
-   static const int PROP_MOTIF_WM_HINTS_ELEMENTS = 5;
+   std::unique_lock<std::mutex> lock(pool.lock);
+   int seen = 0;
+   for (;;) {
+      pool.wake.wait(lock, [&] { return pool.stop || pool.batch != seen; });
+      if (pool.stop)
+         return;
+      seen = pool.batch;
+      lock.unlock();
+      work_on_tasks(self);
+      lock.lock();
+   }
+}
 
-   typedef struct
-   {
-      unsigned long       flags;
-      unsigned long       functions;
-      unsigned long       decorations;
-      long                inputMode;
-      unsigned long       status;
-   } PropMotifWmHints;
+static int
+pool_size(void)
+{
+   int n = pool_threads > 0 ? pool_threads : (int) std::thread::hardware_concurrency();
+   return n > 0 ? n : 1;
+}
 
-   PropMotifWmHints motif_hints;
+static void
+run_tasks(std::vector<task> &tasks)
+{
+   if (pool.queues.empty()) {
+      pool.size = pool_size();
+      for (int i = 0; i < pool.size; i++)
+         pool.queues.push_back(std::unique_ptr<task_queue>(new task_queue));
+      for (int i = 1; i < pool.size; i++)
+         pool.threads.push_back(std::thread(pool_worker, i));
+   }
+
+   pool.remaining = tasks.size();
+   for (size_t i = 0; i < tasks.size(); i++) {
+      task_queue &q = *pool.queues[i % pool.size];
+      std::lock_guard<std::mutex> lock(q.lock);
+      q.tasks.push_back(std::move(tasks[i]));
+   }
+   tasks.clear();
+   {
+      std::lock_guard<std::mutex> lock(pool.lock);
+      pool.batch++;
+   }
+   pool.wake.notify_all();
+
+   work_on_tasks(0);
+   std::unique_lock<std::mutex> lock(pool.lock);
+   pool.done.wait(lock, [] { return pool.remaining == 0; });
+}
+
+static void
+stop_pool(void)
+{
+   {
+      std::lock_guard<std::mutex> lock(pool.lock);
+      pool.stop = true;
+   }
+   pool.wake.notify_all();
+   for (std::thread &thread : pool.threads)
+      thread.join();
+   pool.threads.clear();
+   pool.queues.clear();
+}
+
+/*
+ * Queue the generation of one gear in ranges of teeth_per_task teeth, so
+ * a single huge gear spreads over the pool as well as many small ones.
+ */
+static const GLint teeth_per_task = 1024;
+
+static void
+add_gear_tasks(const gear_shape &shape, int lod, mesh_data *mesh, std::vector<task> &tasks)
+{
+   if (lod > 0) {
+      tasks.push_back([shape, lod, mesh] { generate_gear_lod(shape, lod, *mesh); });
+      return;
+   }
+
+   size_gear_mesh(shape, *mesh);
+   for (GLint first = 0; first < shape.teeth; first += teeth_per_task) {
+      GLint last = first + teeth_per_task < shape.teeth ? first + teeth_per_task : shape.teeth;
+      tasks.push_back([shape, first, last, mesh] {
+         generate_gear_teeth(shape, first, last, *mesh);
+      });
+   }
+}
+
+/*
+ * Whether mesh draws the same triangles as reference.  The vertex counts
+ * may differ, since the reference welds vertices whose rounding differs,
+ * but the indices must walk the same positions in the same order.
+ */
+static bool
+same_gear_mesh(const mesh_data &reference, const mesh_data &mesh)
+{
+   if (mesh.indices.size() != reference.indices.size()) {
+      printf("  mismatch: %zu indices, the reference has %zu\n", mesh.indices.size(),
+             reference.indices.size());
+      return false;
+   }
+   const GLfloat epsilon = 1e-4f;
+   for (size_t i = 0; i < mesh.indices.size(); i++) {
+      const vertex &a = reference.vertices[reference.indices[i]];
+      const vertex &b = mesh.vertices[mesh.indices[i]];
+      for (int c = 0; c < 3; c++) {
+         if (fabsf(a.position[c] - b.position[c]) > epsilon) {
+            printf("  mismatch at index %zu: (%g, %g, %g), the reference has (%g, %g, %g)\n",
+                   i, b.position[0], b.position[1], b.position[2],
+                   a.position[0], a.position[1], a.position[2]);
+            return false;
+         }
+      }
+   }
+   return true;
+}
+
+/*
+ * Check generate_gear() against generate_gear_reference() for a gear with
+ * the given number of teeth, then time them.  Needs no GL context.
+ * Returns false if the meshes differ.
+ */
+static bool
+gear_generation_benchmark(GLint teeth)
+{
+   const gear_shape shape = { 1.0, 4.0, 1.0, teeth, 0.7 };
+   double t0, t1, fast = 1e9;
+
+   printf("%d teeth:\n", teeth);
+   mesh_builder reference;
+   t0 = current_time();
+   generate_gear_reference(shape, reference);
+   t1 = current_time();
+
+   mesh_data mesh;
+   generate_gear(shape, mesh);
+   if (!same_gear_mesh(reference, mesh)) {
+      printf("  fast and reference meshes differ\n");
+      return false;
+   }
+
+   for (int i = 0; i < 5; i++) {
+      double t2 = current_time();
+      generate_gear(shape, mesh);
+      double t3 = current_time();
+      if (t3 - t2 < fast)
+         fast = t3 - t2;
+   }
+
+   printf("  reference: %8.3f ms, %zu vertices, %zu indices\n",
+          (t1 - t0) * 1000.0, reference.vertices.size(), reference.indices.size());
+   printf("  fast:      %8.3f ms, %zu vertices, %zu indices (%.1fx)\n",
+          fast * 1000.0, mesh.vertices.size(), mesh.indices.size(),
+          (t1 - t0) / (fast > 0.0 ? fast : 1e-6));
+
+   /* the same gear in tooth ranges, and as many distinct small gears */
+   double pooled = 1e9, many = 1e9;
+   const GLint small_teeth = 20;
+   const GLint small_gears = teeth / small_teeth > 0 ? teeth / small_teeth : 1;
+   std::vector<mesh_data> meshes(small_gears);
+   std::vector<task> tasks;
+   for (int i = 0; i < 5; i++) {
+      double t2 = current_time();
+      add_gear_tasks(shape, 0, &mesh, tasks);
+      run_tasks(tasks);
+      double t3 = current_time();
+      for (GLint g = 0; g < small_gears; g++) {
+         gear_shape small = { 1.0f + g * 0.001f, 4.0, 1.0, small_teeth, 0.7 };
+         add_gear_tasks(small, 0, &meshes[g], tasks);
+      }
+      run_tasks(tasks);
+      double t4 = current_time();
+      if (t3 - t2 < pooled)
+         pooled = t3 - t2;
+      if (t4 - t3 < many)
+         many = t4 - t3;
+   }
+   printf("  pool:      %8.3f ms on %d threads (%.1fx fast)\n", pooled * 1000.0,
+          pool.size, fast / (pooled > 0.0 ? pooled : 1e-6));
+   printf("  %d distinct %d tooth gears on the pool: %8.3f ms\n", small_gears,
+          small_teeth, many * 1000.0);
+   stop_pool();
+   return true;
+}
+
+/*
+ * Directory of the on-disk caches (programs and gear meshes), created on
+ * first use.  Returns "" if there is nowhere to put it.
+ */
+static std::string
+cache_directory(void)
+{
+   std::string dir;
+   if (cache_dir) {
+      dir = cache_dir;
+   }
+   else if (getenv("XDG_CACHE_HOME")) {
+      dir = std::string(getenv("XDG_CACHE_HOME")) + "/glxgears";
+   }
+   else if (getenv("HOME")) {
+      dir = std::string(getenv("HOME")) + "/.cache";
+      mkdir(dir.c_str(), 0755);
+      dir += "/glxgears";
+   }
+   else {
+      return "";
+   }
+   mkdir(dir.c_str(), 0755);
+   return dir;
+}
+
+/* FNV-1a, for cache keys and image checksums. */
+static const uint64_t fnv1a_basis = 14695981039346656037ull;
+
+static uint64_t
+hash_bytes(uint64_t h, const void *data, size_t size)
+{
+   const unsigned char *p = (const unsigned char *) data;
+   for (size_t i = 0; i < size; i++)
+      h = (h ^ p[i]) * 1099511628211ull;
+   return h;
+}
+
+/* Hashes the terminating NUL too, so "ab" + "c" differs from "a" + "bc". */
+static uint64_t
+hash_string(uint64_t h, const char *str)
+{
+   if (!str)
+      str = "";
+   return hash_bytes(h, str, strlen(str) + 1);
+}
+
+/*
+ * Gear mesh cache.  A generated mesh is written, already in the vertex
+ * layout and index size it is uploaded with, to a file keyed by the gear
+ * parameters and the layout.  Later runs mmap() the file and upload
+ * straight from the mapping.  The header repeats the parameters so a
+ * hash collision or a stale file is never used.
+ */
+static const GLuint mesh_cache_version = 2;
+
+struct mesh_cache_header {
+   char magic[4];                       /* "GMSH" */
+   GLuint version;
+   gear_shape shape;
+   GLfloat color[3];
+   GLuint lod;
+   GLuint packed;
+   GLuint vertex_count;
+   GLuint index_count;
+   GLuint index_size;                   /* 2 or 4 */
+};
+
+/*
+ * Where one mesh's GPU-ready vertex and index data comes from until
+ * upload_arena(): a cache file mapping, or the bytes just generated.
+ */
+struct mesh_source {
+   void *map;                           /* mmap() of a cache file, or NULL */
+   size_t map_size;
+   std::vector<char> generated;         /* without a mapping */
+   const char *vertices;
+   size_t vertex_bytes;
+   const char *indices;
+   GLuint index_size;
+};
+
+static std::string
+mesh_cache_path(const gear_shape &shape, const GLfloat color[3], int lod)
+{
+   std::string dir = mesh_cache ? cache_directory() : "";
+   if (dir.empty())
+      return "";
+
+   GLuint layout[3] = { mesh_cache_version, packed, (GLuint) lod };
+   uint64_t h = fnv1a_basis;
+   h = hash_bytes(h, layout, sizeof(layout));
+   h = hash_bytes(h, &shape, sizeof(shape));
+   h = hash_bytes(h, color, 3 * sizeof(GLfloat));
+
+   char name[40];
+   snprintf(name, sizeof(name), "/gear-%016llx.mesh", (unsigned long long) h);
+   return dir + name;
+}
+
+static mesh_cache_header
+make_mesh_cache_header(const gear_shape &shape, const GLfloat color[3], int lod)
+{
+   mesh_cache_header header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, "GMSH", 4);
+   header.version = mesh_cache_version;
+   header.shape = shape;
+   memcpy(header.color, color, sizeof(header.color));
+   header.lod = lod;
+   header.packed = packed;
+   return header;
+}
+
+/* Map a cached mesh; returns false if there is no usable entry. */
+static bool
+map_cached_mesh(const std::string &path, const mesh_cache_header &expect,
+                mesh_cache_header &header, mesh_source &source)
+{
+   int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      return false;
+   struct stat st;
+   void *map = MAP_FAILED;
+   if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(header))
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return false;
+
+   memcpy(&header, map, sizeof(header));
+   size_t vertex_size = header.packed ? sizeof(packed_vertex) : sizeof(vertex);
+   size_t vertex_bytes = (size_t) header.vertex_count * vertex_size;
+   size_t size = sizeof(header) + vertex_bytes + (size_t) header.index_count * header.index_size;
+   if (memcmp(header.magic, expect.magic, 4) != 0 || header.version != expect.version ||
+       memcmp(&header.shape, &expect.shape, sizeof(header.shape)) != 0 ||
+       memcmp(header.color, expect.color, sizeof(header.color)) != 0 ||
+       header.lod != expect.lod || header.packed != expect.packed ||
+       (header.index_size != 2 && header.index_size != 4) || size != (size_t) st.st_size) {
+      munmap(map, st.st_size);
+      return false;
+   }
+
+   source.map = map;
+   source.map_size = st.st_size;
+   source.vertices = (const char *) map + sizeof(header);
+   source.vertex_bytes = vertex_bytes;
+   source.indices = source.vertices + vertex_bytes;
+   source.index_size = header.index_size;
+   return true;
+}
+
+/* Convert a generated mesh to the upload layout, and cache it if path is set. */
+static void
+store_generated_mesh(const mesh_data &mesh, const std::string &path,
+                     mesh_cache_header &header, mesh_source &source)
+{
+   size_t vertex_size = packed ? sizeof(packed_vertex) : sizeof(vertex);
+   header.vertex_count = mesh.vertices.size();
+   header.index_count = mesh.indices.size();
+   header.index_size = mesh.vertices.size() <= 65536 ? sizeof(GLushort) : sizeof(GLuint);
+
+   source.map = NULL;
+   source.vertex_bytes = header.vertex_count * vertex_size;
+   source.index_size = header.index_size;
+   source.generated.resize(source.vertex_bytes + header.index_count * header.index_size);
+
+   char *dst = source.generated.data();
+   if (packed) {
+      packed_vertex *v = (packed_vertex *) dst;
+      for (size_t i = 0; i < mesh.vertices.size(); i++) {
+         memcpy(v[i].position, mesh.vertices[i].position, sizeof(v[i].position));
+         v[i].normal = pack_normal(mesh.vertices[i].normal);
+      }
+   }
+   else {
+      memcpy(dst, mesh.vertices.data(), source.vertex_bytes);
+   }
+   dst += source.vertex_bytes;
+   if (header.index_size == sizeof(GLushort)) {
+      GLushort *idx = (GLushort *) dst;
+      for (size_t i = 0; i < mesh.indices.size(); i++)
+         idx[i] = mesh.indices[i];
+   }
+   else {
+      memcpy(dst, mesh.indices.data(), header.index_count * sizeof(GLuint));
+   }
+   source.vertices = source.generated.data();
+   source.indices = source.vertices + source.vertex_bytes;
+
+   if (path.empty())
+      return;
+
+   /* write and rename, so a concurrent run never maps half a file */
+   std::string tmp = path + ".tmp";
+   FILE *f = fopen(tmp.c_str(), "wb");
+   if (!f)
+      return;
+   bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(source.generated.data(), 1, source.generated.size(), f) == source.generated.size();
+   if (fclose(f) == 0 && ok)
+      rename(tmp.c_str(), path.c_str());
+   else
+      remove(tmp.c_str());
+}
+
+/* A gear that missed the mesh cache, generated by generate_meshes(). */
+struct mesh_job {
+   gear_shape shape;
+   std::string path;                    /* cache file to write, or "" */
+   mesh_cache_header header;
+   size_t source;                       /* into gear_arena::sources */
+   mesh_data mesh;
+};
+
+/*
+ * All gear meshes share one vertex buffer, one index buffer and one VAO.
+ * gear() appends to the CPU side copy and upload_arena() hands everything
+ * to GL once all gears are known.
+ */
+struct gear_arena {
+   GLuint vbo, ibo;
+   GLenum index_type;                   /* GL_UNSIGNED_SHORT or GL_UNSIGNED_INT */
+   size_t index_size;
+   std::vector<gear_mesh> meshes;
+   std::vector<mesh_source> sources;    /* until upload_arena() */
+   std::vector<struct mesh_job> jobs;   /* meshes still to generate */
+   GLsizei vertex_count, index_count;   /* of all meshes */
+   int cached;                          /* meshes that came from the mesh cache */
+};
+
+static gear_arena arena;
+static thread_local GLuint vao;         /* VAOs are not shared between contexts */
+
+/* Per-draw data of indirectProgram, indexed by gl_DrawIDARB (std430). */
+struct draw_data {
+   GLfloat m[16];
+   GLfloat color[4];
+};
+
+/* Per-frame uniform block "frame" (std140). */
+struct frame_data {
+   GLfloat vp[2][16];                   /* per eye of the pass, see pass_eyes */
+   GLfloat angle;
+   GLfloat pixels_per_unit;             /* for the field's level of detail */
+   GLfloat pad[2];
+};
+
+/* Layout of one glMultiDrawElementsIndirect command. */
+struct draw_command {
+   GLuint count;
+   GLuint instance_count;
+   GLuint first_index;
+   GLint base_vertex;
+   GLuint base_instance;
+};
+
+/* One command per gear of the scene. */
+static const int scene_commands = 3;
+
+/* Point attributes 0 and 1 of the bound VAO at a gear vertex buffer. */
+static void
+bind_gear_vertices(GLuint vbo)
+{
+   glBindBuffer(GL_ARRAY_BUFFER, vbo);
+   if (packed) {
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(packed_vertex), (void*)0);
+      glEnableVertexAttribArray(1);
+      glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(packed_vertex), (void*)12);
+   }
+   else {
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)0);
+      glEnableVertexAttribArray(1);
+      glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)12);
+   }
+}
+
+/* A gear_mesh with the parameters and bounds of a gear, but no geometry. */
+static gear_mesh
+describe_gear(const gear_shape &shape, const GLfloat color[3], int lod)
+{
+   gear_mesh g;
+   memset(&g, 0, sizeof(g));
+   g.teeth = shape.teeth;
+   g.lod = lod;
+   g.radius = shape.outer_radius + shape.tooth_depth / 2.0;
+   g.bound = sqrtf(g.radius * g.radius + shape.width * shape.width / 4.0f);
+   memcpy(g.color, color, sizeof(g.color));
+   g.shape[0] = shape.inner_radius;
+   g.shape[1] = shape.outer_radius;
+   g.shape[2] = shape.width;
+   g.shape[3] = shape.tooth_depth;
+   return g;
+}
+
+/* Add one level of detail of a gear to the arena. */
+static gear_mesh
+gear_lod(const gear_shape &shape, const GLfloat color[3], int lod)
+{
+   std::string path = mesh_cache_path(shape, color, lod);
+   mesh_cache_header expect = make_mesh_cache_header(shape, color, lod), header = expect;
+   arena.sources.push_back(mesh_source());
+   mesh_source &source = arena.sources.back();
+   if (!path.empty() && map_cached_mesh(path, expect, header, source)) {
+      arena.cached++;
+   }
+   else {
+      size_t vertices, indices;
+      lod_mesh_size(shape, lod, vertices, indices);
+      header.vertex_count = vertices;
+      header.index_count = indices;
+      mesh_job job;
+      job.shape = shape;
+      job.path = path;
+      job.header = header;
+      job.source = arena.sources.size() - 1;
+      arena.jobs.push_back(job);
+   }
+
+   gear_mesh g = describe_gear(shape, color, lod);
+   g.index = arena.meshes.size();
+   g.vertex_count = header.vertex_count;
+   g.count = header.index_count;
+   g.first_index = arena.index_count;
+   g.base_vertex = arena.vertex_count;
+
+   arena.vertex_count += g.vertex_count;
+   arena.index_count += g.count;
+   arena.meshes.push_back(g);
+
+   return g;
+}
+
+/*
+ *
+ *  Build a gear wheel and its coarser levels of detail and add them to
+ *  the arena.
+ * 
+ *  Input:  inner_radius - radius of hole at center
+ *          outer_radius - radius at center of teeth
+ *          width - width of gear
+ *          teeth - number of teeth
+ *          tooth_depth - depth of tooth
+ */
+static gear_mesh gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
+     GLint teeth, GLfloat tooth_depth, GLfloat red, GLfloat green, GLfloat blue)
+{
+   gear_shape shape = { inner_radius, outer_radius, width, teeth, tooth_depth };
+   GLfloat color[3] = { red, green, blue };
+
+   /* -procedural: drawn with one vertex per index, nothing in the arena */
+   if (procedural) {
+      gear_mesh g = describe_gear(shape, color, 0);
+      g.count = teeth * tooth_indices;
+      return g;
+   }
+
+   gear_mesh g = gear_lod(shape, color, 0);
+   for (int lod = 1; lod < gear_lods; lod++)
+      gear_lod(shape, color, lod);
+   return g;
+}
+
+/* The level of detail lod of gear g. */
+static const gear_mesh &
+lod_mesh(const gear_mesh &g, int lod)
+{
+   return lod == 0 ? g : arena.meshes[g.index + lod];
+}
+
+/*
+ * Generate every queued mesh on the thread pool, then convert each one to
+ * its upload layout (and write its cache file) on the pool as well.
+ */
+static void
+generate_meshes(void)
+{
+   if (arena.jobs.empty())
+      return;
+
+   double t0 = current_time();
+   std::vector<task> tasks;
+   for (mesh_job &job : arena.jobs)
+      add_gear_tasks(job.shape, job.header.lod, &job.mesh, tasks);
+   run_tasks(tasks);
+
+   for (mesh_job &job : arena.jobs) {
+      mesh_job *j = &job;
+      tasks.push_back([j] {
+         store_generated_mesh(j->mesh, j->path, j->header, arena.sources[j->source]);
+         j->mesh = mesh_data();
+      });
+   }
+   run_tasks(tasks);
+
+   if (printInfo)
+      printf("generated %zu gear meshes on %d threads in %.3f ms\n", arena.jobs.size(),
+             pool.size, (current_time() - t0) * 1000.0);
+   arena.jobs.clear();
+}
+
+/*
+ * Upload every mesh built so far into the shared buffers, straight from
+ * the cache mappings or the generated bytes.
+ */
+static void
+upload_arena(void)
+{
+   GLsizei largest = 0;
+   for (const gear_mesh &g : arena.meshes) {
+      if (g.vertex_count > largest)
+         largest = g.vertex_count;
+   }
+   size_t vertex_size = packed ? sizeof(packed_vertex) : sizeof(vertex);
+
+   glGenBuffers(1, &arena.vbo);
+   glBindBuffer(GL_ARRAY_BUFFER, arena.vbo);
+   glBufferData(GL_ARRAY_BUFFER, vertex_size * arena.vertex_count, NULL, GL_STATIC_DRAW);
+
+   /* Short indices whenever every mesh allows it; they are relative to
+    * each mesh's base vertex. */
+   if (largest <= 65536) {
+      arena.index_type = GL_UNSIGNED_SHORT;
+      arena.index_size = sizeof(GLushort);
+   }
+   else {
+      arena.index_type = GL_UNSIGNED_INT;
+      arena.index_size = sizeof(GLuint);
+   }
+   glGenBuffers(1, &arena.ibo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER, arena.index_size * arena.index_count, NULL, GL_STATIC_DRAW);
+
+   for (size_t i = 0; i < arena.meshes.size(); i++) {
+      const gear_mesh &g = arena.meshes[i];
+      mesh_source &source = arena.sources[i];
+      glBufferSubData(GL_ARRAY_BUFFER, g.base_vertex * vertex_size, source.vertex_bytes,
+                      source.vertices);
+      if (source.index_size == arena.index_size) {
+         glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, g.first_index * arena.index_size,
+                         g.count * arena.index_size, source.indices);
+      }
+      else {
+         /* a small mesh with short indices next to one that needs 32 bits */
+         std::vector<GLuint> wide(g.count);
+         for (GLsizei j = 0; j < g.count; j++)
+            wide[j] = ((const GLushort *) source.indices)[j];
+         glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, g.first_index * arena.index_size,
+                         g.count * arena.index_size, wide.data());
+      }
+      if (source.map)
+         munmap(source.map, source.map_size);
+   }
+
+   if (printInfo) {
+      for (const gear_mesh &g : arena.meshes) {
+         if (g.lod == 0)
+            printf("gear with %d teeth: %d vertices, %d indices, %zu bytes "
+                   "(was %zu bytes unindexed)\n", g.teeth, g.vertex_count, g.count,
+                   g.vertex_count * vertex_size + g.count * arena.index_size,
+                   g.teeth * unindexed_vertices_per_tooth * unindexed_vertex_size);
+         else
+            printf("  lod %d: %d vertices, %d indices, %zu bytes\n", g.lod,
+                   g.vertex_count, g.count,
+                   g.vertex_count * vertex_size + g.count * arena.index_size);
+      }
+      printf("%d of %zu gear meshes from the mesh cache\n", arena.cached,
+             arena.meshes.size());
+   }
+
+   arena.sources.clear();
+}
+
+static void
+delete_arena(void)
+{
+   glDeleteBuffers(1, &arena.vbo);
+   glDeleteBuffers(1, &arena.ibo);
+}
+
+static draw_command
+gear_command(const gear_mesh &g, GLuint instances, GLuint base_instance)
+{
+   draw_command cmd = { (GLuint) g.count, instances, g.first_index,
+                        g.base_vertex, base_instance };
+   return cmd;
+}
+
+/*
+ * Per-frame data (view projection, animation angle), per-object data
+ * (draw_data), the indirect draw commands and the field's instances live
+ * in a ring of frame_ring_size segments of one buffer, so the commands can
+ * change every frame with the level of detail of each gear.  With
+ * GL_ARB_buffer_storage the buffer is persistently mapped and written in
+ * place; a fence per segment keeps the CPU from overwriting data the GPU
+ * has not consumed yet.  Without it, each segment is uploaded with
+ * glBufferSubData.
+ */
+static const int frame_ring_size = 3;
+
+struct frame_ring {
+   GLuint buffer;
+   char *map;                           /* persistent mapping, or NULL */
+   std::vector<char> shadow;            /* segment being written without one */
+   size_t draws_offset;                 /* of draw_data within a segment */
+   size_t commands_offset;              /* of the draw_commands */
+   size_t instances_offset;             /* of the animated_instances */
+   size_t segment_size;
+   int current;
+   GLsync fences[frame_ring_size];
+};
+
+static thread_local frame_ring ring;
+
+static size_t
+align_up(size_t size, size_t alignment)
+{
+   return (size + alignment - 1) / alignment * alignment;
+}
+
+static void
+create_frame_ring(size_t max_draws, size_t max_commands, size_t max_instances,
+                  size_t instance_size)
+{
+   GLint ubo_alignment = 1, ssbo_alignment = 1;
+   glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_alignment);
+   if (max_draws > 0)
+      glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssbo_alignment);
+   size_t alignment = ubo_alignment > ssbo_alignment ? ubo_alignment : ssbo_alignment;
+
+   ring.draws_offset = align_up(sizeof(frame_data), alignment);
+   ring.commands_offset = align_up(ring.draws_offset + max_draws * sizeof(draw_data), 16);
+   ring.instances_offset = align_up(ring.commands_offset + max_commands * sizeof(draw_command), 16);
+   ring.segment_size = align_up(ring.instances_offset + max_instances * instance_size, alignment);
+   size_t size = ring.segment_size * frame_ring_size;
+
+   glGenBuffers(1, &ring.buffer);
+   glBindBuffer(GL_UNIFORM_BUFFER, ring.buffer);
+   if (GLEW_ARB_buffer_storage) {
+      GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_UNIFORM_BUFFER, size, NULL, flags);
+      ring.map = (char *) glMapBufferRange(GL_UNIFORM_BUFFER, 0, size, flags);
+   }
+   else {
+      glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_STREAM_DRAW);
+      ring.shadow.resize(ring.segment_size);
+   }
+}
+
+static void
+delete_frame_ring(void)
+{
+   for (int i = 0; i < frame_ring_size; i++) {
+      if (ring.fences[i])
+         glDeleteSync(ring.fences[i]);
+   }
+   glDeleteBuffers(1, &ring.buffer);
+}
+
+/* Wait until the GPU is done with the current segment and return it. */
+static void *
+begin_frame_data(void)
+{
+   GLsync &fence = ring.fences[ring.current];
+   if (fence) {
+      while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+         ;
+      glDeleteSync(fence);
+      fence = 0;
+   }
+   return ring.map ? ring.map + ring.current * ring.segment_size : ring.shadow.data();
+}
+
+/* Offset in the ring buffer of an area of the current segment. */
+static size_t
+frame_offset(size_t area_offset)
+{
+   return ring.current * ring.segment_size + area_offset;
+}
+
+/* Bind the segment for drawing: frame_data as uniform block 0, the first
+ * "draws" draw_data entries as storage block 0.  "used" bytes of the
+ * segment have been written. */
+static void
+end_frame_data(size_t draws, size_t used)
+{
+   size_t offset = frame_offset(0);
+   if (!ring.map) {
+      glBindBuffer(GL_UNIFORM_BUFFER, ring.buffer);
+      glBufferSubData(GL_UNIFORM_BUFFER, offset, used, ring.shadow.data());
+   }
+   glBindBufferRange(GL_UNIFORM_BUFFER, 0, ring.buffer, offset, sizeof(frame_data));
+   if (draws > 0)
+      glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, ring.buffer,
+                        offset + ring.draws_offset, draws * sizeof(draw_data));
+}
+
+/* Called after the segment's draws; moves on to the next segment. */
+static void
+fence_frame_data(void)
+{
+   if (ring.map)
+      ring.fences[ring.current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   ring.current = (ring.current + 1) % frame_ring_size;
+}
+
+/* Fallback for drivers without multi-draw-indirect, and -procedural. */
+static void draw_gear(const gear_mesh &g, const glm::mat4 &m)
+{
+   glUniformMatrix4fv(mLocation, 1, false, glm::value_ptr(m));
+   glUniform3fv(colorLocation, 1, g.color);
+   if (procedural) {
+      glUniform4fv(shapeLocation, 1, g.shape);
+      glUniform1i(teethLocation, g.teeth);
+      glDrawArraysInstanced(GL_TRIANGLES, 0, g.count, pass_eyes);
+      return;
+   }
+   glDrawElementsInstancedBaseVertex(GL_TRIANGLES, g.count, arena.index_type,
+                                     (void *) (g.first_index * arena.index_size), pass_eyes,
+                                     g.base_vertex);
+}
+
+/*
+ * View frustum culling.  Every gear has a bounding sphere around its
+ * center; the six planes of the view projection are extracted and
+ * normalized once per draw, and the spheres are kept as separate x, y, z
+ * and radius arrays so that four of them are tested against a plane at a
+ * time with SSE.
+ */
+struct frustum {
+   GLfloat plane[6][4];                 /* inside where a*x + b*y + c*z + d >= 0 */
+};
+
+struct sphere_set {
+   std::vector<GLfloat> x, y, z, r;
+
+   void resize(size_t n) { x.resize(n); y.resize(n); z.resize(n); r.resize(n); }
+   void set(size_t i, GLfloat cx, GLfloat cy, GLfloat cz, GLfloat radius)
+   {
+      x[i] = cx;
+      y[i] = cy;
+      z[i] = cz;
+      r[i] = radius;
+   }
+};
+
+static GLboolean use_cull = GL_TRUE;    /* -nocull turns this off */
+
+/* Gears drawn and culled, summed over an interval's frames. */
+struct cull_stats {
+   double visible;
+   double culled;
+};
+
+static thread_local cull_stats cull_counts;
+
+/* Left, right, bottom, top, near and far planes of the space vp transforms. */
+static frustum
+view_frustum(const glm::mat4 &vp)
+{
+   frustum f;
+   for (int i = 0; i < 6; i++) {
+      int row = i / 2;
+      GLfloat sign = (i & 1) ? -1.0f : 1.0f;
+      for (int c = 0; c < 4; c++)
+         f.plane[i][c] = vp[c][3] + sign * vp[c][row];
+      GLfloat length = sqrtf(f.plane[i][0] * f.plane[i][0] + f.plane[i][1] * f.plane[i][1] +
+                             f.plane[i][2] * f.plane[i][2]);
+      for (int c = 0; c < 4; c++)
+         f.plane[i][c] /= length;
+   }
+   return f;
+}
+
+static inline bool
+sphere_visible(const frustum &f, GLfloat x, GLfloat y, GLfloat z, GLfloat r)
+{
+   for (int i = 0; i < 6; i++) {
+      const GLfloat *p = f.plane[i];
+      if (p[0] * x + p[1] * y + p[2] * z + p[3] < -r)
+         return false;
+   }
+   return true;
+}
+
+/*
+ * Append the indices of the spheres [first, last) that intersect the
+ * frustum to visible and return how many there were.
+ */
+static size_t
+cull_spheres(const frustum &f, const sphere_set &s, size_t first, size_t last,
+             GLuint *visible)
+{
+   size_t count = 0, i = first;
+#ifdef __SSE2__
+   __m128 plane[6][4];
+   for (int p = 0; p < 6; p++) {
+      for (int c = 0; c < 4; c++)
+         plane[p][c] = _mm_set1_ps(f.plane[p][c]);
+   }
+   for (; i + 4 <= last; i += 4) {
+      __m128 x = _mm_loadu_ps(&s.x[i]), y = _mm_loadu_ps(&s.y[i]);
+      __m128 z = _mm_loadu_ps(&s.z[i]);
+      __m128 r = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&s.r[i]));
+      __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+      for (int p = 0; p < 6; p++) {
+         __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(plane[p][0], x), _mm_mul_ps(plane[p][1], y)),
+                               _mm_add_ps(_mm_mul_ps(plane[p][2], z), plane[p][3]));
+         inside = _mm_and_ps(inside, _mm_cmpge_ps(d, r));
+      }
+      int mask = _mm_movemask_ps(inside);
+      for (int k = 0; k < 4; k++) {
+         visible[count] = i + k;
+         count += (mask >> k) & 1;
+      }
+   }
+#endif
+   for (; i < last; i++) {
+      visible[count] = i;
+      count += sphere_visible(f, s.x[i], s.y[i], s.z[i], s.r[i]);
+   }
+   return count;
+}
+
+/*
+ * Screen-space level of detail: a gear whose bounding circle projects to
+ * fewer than lod_pixels[0] pixels of radius loses its teeth (LOD 1), below
+ * lod_pixels[1] it becomes a hexagon (LOD 2).  The choice is made on the
+ * CPU every frame, for every gear.
+ */
+static const GLfloat lod_pixels[gear_lods - 1] = { 10.0f, 4.0f };
+static GLboolean use_lod = GL_TRUE;     /* -nolod turns this off */
+static GLfloat lod_bias = 1.0f;         /* -lod-bias: scales projected sizes */
+
+/* What the level of detail saved, summed over an interval's frames. */
+struct lod_stats {
+   double gears[gear_lods];
+   double triangles;                    /* submitted */
+   double full_triangles;               /* had every gear been drawn at LOD 0 */
+};
+
+static thread_local lod_stats lod_counts;
+
+/*
+ * Level of detail of a gear centered at (x, y, 0) in the space transformed
+ * by vp.  pixel_radius is its radius times the pixels per unit at distance
+ * 1 from the eye, so dividing by clip w gives its radius on screen.
+ */
+static int
+select_lod(const glm::mat4 &vp, GLfloat x, GLfloat y, GLfloat pixel_radius)
+{
+   if (!use_lod)
+      return 0;
+   GLfloat w = vp[0][3] * x + vp[1][3] * y + vp[3][3];
+   if (w <= 0.0f)
+      return 0;
+   GLfloat pixels = pixel_radius * lod_bias / w;
+   int lod = 0;
+   while (lod < gear_lods - 1 && pixels < lod_pixels[lod])
+      lod++;
+   return lod;
+}
+
+static void
+count_lod(const gear_mesh &full, const gear_mesh &g, GLuint instances)
+{
+   lod_counts.gears[g.lod] += instances;
+   lod_counts.triangles += (double) instances * g.count / 3;
+   lod_counts.full_triangles += (double) instances * full.count / 3;
+}
+
+/*
+ * Gear animation.  A gear turns ratio degrees per degree of angle from its
+ * phase about its center, so all its model matrix holds is the center and
+ * the cos/sin of one rotation about z.  gear_animation keeps centers,
+ * phases and ratios as structure of arrays, and animate_gears() computes
+ * those transforms for a batch of gears four at a time with SSE, storing
+ * each (x, y, cos, sin) at a stride so they can go straight into a vertex
+ * stream.  The angle is reduced in degrees, where 360 and 90 are exact,
+ * before a polynomial sin/cos on [-45, 45] degrees; the scalar tail does
+ * the same arithmetic, so a gear's transform does not depend on its lane.
+ */
+struct gear_animation {
+   std::vector<GLfloat> x, y;           /* center */
+   std::vector<GLfloat> phase;          /* degrees */
+   std::vector<GLfloat> ratio;          /* degrees turned per degree of angle */
+
+   void resize(size_t n) { x.resize(n); y.resize(n); phase.resize(n); ratio.resize(n); }
+   void set(size_t i, GLfloat cx, GLfloat cy, GLfloat p, GLfloat r)
+   {
+      x[i] = cx;
+      y[i] = cy;
+      phase[i] = p;
+      ratio[i] = r;
+   }
+};
+
+/* The classic three gears, turning against each other. */
+static gear_animation scene_animation;
+
+/* Quarter turns that d degrees reduce by, and the rest in radians. */
+static inline GLfloat
+reduce_degrees(GLfloat d, int &quarter)
+{
+   d -= 360.0f * nearbyintf(d * (1.0f / 360.0f));
+   GLfloat q = nearbyintf(d * (1.0f / 90.0f));
+   quarter = (int) q;
+   return (d - 90.0f * q) * (GLfloat) (M_PI / 180.0);
+}
+
+static inline void
+sincos_degrees(GLfloat d, GLfloat &c, GLfloat &s)
+{
+   int q;
+   GLfloat r = reduce_degrees(d, q);
+   GLfloat r2 = r * r;
+   GLfloat sr = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+   GLfloat cr = 1.0f - 0.5f * r2 +
+                r2 * r2 * (4.166664568e-2f + r2 * (-1.388731625e-3f + r2 * 2.443315712e-5f));
+   s = (q & 1) ? cr : sr;
+   c = (q & 1) ? sr : cr;
+   if (q & 2)
+      s = -s;
+   if ((q + 1) & 2)
+      c = -c;
+}
+
+#ifdef __SSE2__
+/* sincos_degrees() of four angles, with the same rounding. */
+static inline void
+sincos_degrees(f4 d, f4 &c, f4 &s)
+{
+   __m128 turns = _mm_cvtepi32_ps(_mm_cvtps_epi32((d * f4(1.0f / 360.0f)).v));
+   d = d - f4(360.0f) * turns;
+   __m128i qi = _mm_cvtps_epi32((d * f4(1.0f / 90.0f)).v);
+   f4 r = (d - f4(90.0f) * _mm_cvtepi32_ps(qi)) * f4((GLfloat) (M_PI / 180.0));
+   f4 r2 = r * r;
+   f4 sr = r + r * r2 * (f4(-1.6666654611e-1f) + r2 * (f4(8.3321608736e-3f) +
+                                                        r2 * f4(-1.9515295891e-4f)));
+   f4 cr = f4(1.0f) - f4(0.5f) * r2 +
+           r2 * r2 * (f4(4.166664568e-2f) + r2 * (f4(-1.388731625e-3f) + r2 * f4(2.443315712e-5f)));
+
+   const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2);
+   __m128 odd = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(qi, one), one));
+   __m128 sin_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(qi, two), 30));
+   __m128 cos_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(qi, one), two), 30));
+   s = _mm_xor_ps(_mm_or_ps(_mm_and_ps(odd, cr.v), _mm_andnot_ps(odd, sr.v)), sin_sign);
+   c = _mm_xor_ps(_mm_or_ps(_mm_and_ps(odd, sr.v), _mm_andnot_ps(odd, cr.v)), cos_sign);
+}
+#endif
+
+/*
+ * Store the transforms (x, y, cos, sin) of gears index[0, n) of a at
+ * angle to out, stride floats apart.
+ */
+static void
+animate_gears(const gear_animation &a, const GLuint *index, size_t n, GLfloat angle,
+              GLfloat *out, size_t stride)
+{
+   size_t i = 0;
+#ifdef __SSE2__
+   for (; i + 4 <= n; i += 4) {
+      const GLuint *k = index + i;
+      f4 phase = _mm_setr_ps(a.phase[k[0]], a.phase[k[1]], a.phase[k[2]], a.phase[k[3]]);
+      f4 ratio = _mm_setr_ps(a.ratio[k[0]], a.ratio[k[1]], a.ratio[k[2]], a.ratio[k[3]]);
+      f4 c(0.0f), s(0.0f);
+      sincos_degrees(ratio * f4(angle) + phase, c, s);
+      __m128 r0 = _mm_setr_ps(a.x[k[0]], a.x[k[1]], a.x[k[2]], a.x[k[3]]);
+      __m128 r1 = _mm_setr_ps(a.y[k[0]], a.y[k[1]], a.y[k[2]], a.y[k[3]]);
+      __m128 r2 = c.v, r3 = s.v;
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      GLfloat *dst = out + i * stride;
+      _mm_storeu_ps(dst, r0);
+      _mm_storeu_ps(dst + stride, r1);
+      _mm_storeu_ps(dst + 2 * stride, r2);
+      _mm_storeu_ps(dst + 3 * stride, r3);
+   }
+#endif
+   for (; i < n; i++) {
+      GLuint k = index[i];
+      GLfloat *dst = out + i * stride;
+      dst[0] = a.x[k];
+      dst[1] = a.y[k];
+      sincos_degrees(a.ratio[k] * angle + a.phase[k], dst[2], dst[3]);
+   }
+}
+
+/*
+ * Gear field (-gears N): N gears on a square grid, each one meshing with its
+ * horizontal and vertical neighbours.  Neighbours alternate between the two
+ * 10 tooth meshes and turn in opposite directions.  -scene loads a field
+ * of up to max_field_types meshes from a file instead.  Every frame the
+ * visible instances are sorted into one bucket per mesh type and level of
+ * detail, animated with animate_gears() and written, with their colors,
+ * to the instance attributes in the frame ring, so the whole field is one
+ * indirect draw command per bucket (or one instanced draw per bucket
+ * without multi-draw-indirect).
+ */
+struct gear_instance {
+   GLfloat position[2];
+   GLfloat phase;                       /* degrees */
+   GLfloat ratio;                       /* degrees turned per degree of angle */
+   GLfloat color[3];
+};
+
+/* A field instance as the vertex shader gets it, for one frame. */
+struct animated_instance {
+   GLfloat transform[4];                /* x, y, cos, sin */
+   GLfloat color[3];
+};
+
+static const int max_field_types = 8;   /* meshes in one field */
+
+struct gear_field {
+   GLuint program;
+   std::vector<gear_instance> instances; /* grouped by mesh */
+   gear_animation animation;            /* of the instances */
+   sphere_set spheres;                  /* bounds of the instances */
+   GLuint instance_buffer;              /* instances, for -gpucull */
+   GLuint cull_program, compact_program;
+   int types;                           /* meshes in use */
+   gear_mesh mesh[max_field_types];
+   GLsizei first[max_field_types];      /* instances of each mesh */
+   GLsizei count[max_field_types];
+   GLfloat scale;                       /* fits the whole field into view */
+};
+
+static gear_field field;
+
+static const int field_buckets = max_field_types * gear_lods;
+
+/*
+ * Buffers of the current context for -gpucull: the visible instances
+ * (one region per mesh and level of detail, each big enough for every
+ * instance of the mesh), the bucket commands the cull pass counts into,
+ * and the compacted draw commands preceded by their count.
+ */
+struct gpu_culling {
+   GLuint visible;
+   GLuint buckets;
+   GLuint draws;
+};
+
+static thread_local gpu_culling gpu_culling;
+static const size_t gpu_draws_offset = 16;  /* of the commands in draws */
+
+/* Cull and bucket the field on the GPU; the CPU cost is constant. */
+static void
+draw_field_gpu(void)
+{
+   end_frame_data(0, sizeof(frame_data));
+   glUseProgram(field.cull_program);
+   glDispatchCompute((field.instances.size() + 63) / 64, 1, 1);
+   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+   glUseProgram(field.compact_program);
+   glDispatchCompute(1, 1, 1);
+   glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+                   GL_SHADER_STORAGE_BARRIER_BIT);
+   glUseProgram(field.program);
+   if (GLEW_ARB_indirect_parameters)
+      glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, arena.index_type,
+                                          (void *) gpu_draws_offset, 0, field_buckets, 0);
+   else
+      glMultiDrawElementsIndirect(GL_TRIANGLES, arena.index_type,
+                                  (void *) gpu_draws_offset, field_buckets, 0);
+}
+
+/*
+ * Animate the field instances order[0, n) into out.  Above
+ * animate_task_gears twice over the batch is split over the thread pool,
+ * which only one render thread may use.
+ */
+static const size_t animate_task_gears = 16384;
+
+static void
+animate_field(const GLuint *order, size_t n, animated_instance *out)
+{
+   const GLfloat a = angle;
+   auto animate = [order, out, a](size_t first, size_t last) {
+      animate_gears(field.animation, order + first, last - first, a,
+                    out[first].transform, sizeof(animated_instance) / sizeof(GLfloat));
+      for (size_t i = first; i < last; i++)
+         memcpy(out[i].color, field.instances[order[i]].color, sizeof(out[i].color));
+   };
+
+   if (n < 2 * animate_task_gears || num_windows > 1) {
+      animate(0, n);
+      return;
+   }
+   std::vector<task> tasks;
+   for (size_t first = 0; first < n; first += animate_task_gears) {
+      size_t last = first + animate_task_gears < n ? first + animate_task_gears : n;
+      tasks.push_back([animate, first, last] { animate(first, last); });
+   }
+   run_tasks(tasks);
+}
+
+/* Instances in [first, last) inside the frustum of any eye, in order. */
+static size_t
+cull_field(const frustum *f, size_t first, size_t last, GLuint *visible)
+{
+   size_t n = cull_spheres(f[0], field.spheres, first, last, visible);
+   if (pass_eyes == 1)
+      return n;
+
+   static thread_local std::vector<GLuint> left_visible, right_visible;
+   left_visible.assign(visible, visible + n);
+   right_visible.resize(last - first);
+   size_t m = cull_spheres(f[1], field.spheres, first, last, right_visible.data());
+   return std::set_union(left_visible.begin(), left_visible.end(), right_visible.begin(),
+                         right_visible.begin() + m, visible) - visible;
+}
+
+static void
+draw_field(char *segment, const glm::mat4 *vp, GLfloat pixels_per_unit)
+{
+   if (gpu_cull) {
+      draw_field_gpu();
+      return;
+   }
+
+   static thread_local std::vector<GLuint> visible;
+   static thread_local std::vector<unsigned char> bucket;
+   static thread_local std::vector<GLuint> order;
+   GLuint count[field_buckets] = { 0 }, first[field_buckets], next[field_buckets];
+   size_t visible_end[max_field_types];
+   size_t total_instances = field.instances.size(), n = 0;
+   int buckets = field.types * gear_lods;
+
+   /* visible instances stay grouped by mesh */
+   visible.resize(total_instances);
+   frustum f[2] = { view_frustum(vp[0]), view_frustum(vp[1]) };
+   for (int type = 0; type < field.types; type++) {
+      size_t begin = field.first[type], end = begin + field.count[type];
+      if (use_cull) {
+         n += cull_field(f, begin, end, visible.data() + n);
+      }
+      else {
+         for (size_t i = begin; i < end; i++)
+            visible[n++] = i;
+      }
+      visible_end[type] = n;
+   }
+   cull_counts.visible += n;
+   cull_counts.culled += total_instances - n;
+
+   bucket.resize(n);
+   for (size_t i = 0, type = 0; i < n; i++) {
+      while (i == visible_end[type])
+         type++;
+      const gear_instance &inst = field.instances[visible[i]];
+      int lod = select_lod(vp[0], inst.position[0], inst.position[1],
+                           field.mesh[type].radius * pixels_per_unit);
+      bucket[i] = type * gear_lods + lod;
+      count[bucket[i]]++;
+   }
+
+   GLuint total = 0;
+   for (int b = 0; b < buckets; b++) {
+      first[b] = next[b] = total;
+      total += count[b];
+   }
+   order.resize(n);
+   for (size_t i = 0; i < n; i++)
+      order[next[bucket[i]]++] = visible[i];
+   animate_field(order.data(), n, (animated_instance *) (segment + ring.instances_offset));
+
+   draw_command *commands = (draw_command *) (segment + ring.commands_offset);
+   for (int b = 0; b < buckets; b++) {
+      const gear_mesh &full = field.mesh[b / gear_lods];
+      const gear_mesh &g = lod_mesh(full, b % gear_lods);
+      commands[b] = gear_command(g, count[b] * pass_eyes, first[b]);
+      count_lod(full, g, count[b]);
+   }
+   end_frame_data(0, ring.instances_offset + n * sizeof(animated_instance));
+
+   size_t instances = frame_offset(ring.instances_offset);
+   glBindBuffer(GL_ARRAY_BUFFER, ring.buffer);
+   if (indirect) {
+      glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(animated_instance), (void *) instances);
+      glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(animated_instance),
+                            (void *) (instances + 16));
+      glMultiDrawElementsIndirect(GL_TRIANGLES, arena.index_type,
+                                  (void *) frame_offset(ring.commands_offset), buckets, 0);
+      return;
+   }
+
+   for (int b = 0; b < buckets; b++) {
+      const draw_command &cmd = commands[b];
+      size_t offset = instances + cmd.base_instance * sizeof(animated_instance);
+      if (cmd.instance_count == 0)
+         continue;
+      glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(animated_instance), (void *) offset);
+      glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(animated_instance),
+                            (void *) (offset + 16));
+      glDrawElementsInstancedBaseVertex(GL_TRIANGLES, cmd.count, arena.index_type,
+                                        (void *) (cmd.first_index * arena.index_size),
+                                        cmd.instance_count, cmd.base_vertex);
+   }
+}
+
+/* Draw the gears with the view projection of each of the pass_eyes eyes. */
+static void draw(const glm::mat4 *eye_projection)
+{
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+   /* the rotations and translation leave the projection's y scale alone */
+   GLfloat pixels_per_unit = eye_projection[0][1][1] * win_height * render_scale * 0.5f;
+
+   /* a single eye is repeated, so the frustums can always be tested in pairs */
+   glm::mat4 view_projection[2];
+   for (int eye = 0; eye < 2; eye++) {
+      glm::mat4 &vp = view_projection[eye];
+      vp = eye_projection[eye < pass_eyes ? eye : 0];
+      vp = glm::rotate(vp, view_rotx / degrees_per_rad, glm::vec3(1.0, 0.0, 0.0));
+      vp = glm::rotate(vp, view_roty / degrees_per_rad, glm::vec3(0.0, 1.0, 0.0));
+      vp = glm::rotate(vp, view_rotz / degrees_per_rad, glm::vec3(0.0, 0.0, 1.0));
+      if (field_gears > 0)
+         vp = glm::scale(vp, glm::vec3(field.scale));
+   }
+
+   frame_data *frame = (frame_data *) begin_frame_data();
+   frame->angle = angle;
+   for (int eye = 0; eye < 2; eye++)
+      memcpy(frame->vp[eye], glm::value_ptr(view_projection[eye]), sizeof(frame->vp[eye]));
+
+   if (field_gears > 0) {
+      frame->pixels_per_unit = pixels_per_unit * field.scale;
+      draw_field((char *) frame, view_projection, frame->pixels_per_unit);
+      fence_frame_data();
+      return;
+   }
+
+   const gear_mesh *gears[3] = { &gear1, &gear2, &gear3 };
+   static const GLuint scene_gears[3] = { 0, 1, 2 };
+   GLfloat t[3][4];
+   animate_gears(scene_animation, scene_gears, 3, angle, t[0], 4);
+   glm::mat4 m[3];
+   for (int i = 0; i < 3; i++) {
+      m[i] = glm::mat4(glm::vec4(t[i][2], t[i][3], 0.0f, 0.0f),
+                       glm::vec4(-t[i][3], t[i][2], 0.0f, 0.0f),
+                       glm::vec4(0.0f, 0.0f, 1.0f, 0.0f),
+                       glm::vec4(t[i][0], t[i][1], 0.0f, 1.0f));
+   }
+
+   /* culled gears keep their command, with no instances */
+   bool drawn[3];
+   frustum f[2] = { view_frustum(view_projection[0]), view_frustum(view_projection[1]) };
+   const gear_mesh *lods[3];
+   for (int i = 0; i < 3; i++) {
+      drawn[i] = !use_cull;
+      for (int eye = 0; eye < pass_eyes && !drawn[i]; eye++)
+         drawn[i] = sphere_visible(f[eye], m[i][3][0], m[i][3][1], m[i][3][2], gears[i]->bound);
+      int lod = select_lod(view_projection[0], m[i][3][0], m[i][3][1],
+                           gears[i]->radius * pixels_per_unit);
+      lods[i] = &lod_mesh(*gears[i], lod);
+      if (drawn[i])
+         count_lod(*gears[i], *lods[i], 1);
+      cull_counts.visible += drawn[i];
+      cull_counts.culled += !drawn[i];
+   }
+
+   if (indirect) {
+      draw_data *data = (draw_data *) ((char *) frame + ring.draws_offset);
+      draw_command *commands = (draw_command *) ((char *) frame + ring.commands_offset);
+      for (int i = 0; i < 3; i++) {
+         memcpy(data[i].m, glm::value_ptr(m[i]), sizeof(data[i].m));
+         memcpy(data[i].color, gears[i]->color, sizeof(gears[i]->color));
+         data[i].color[3] = 1.0;
+         commands[i] = gear_command(*lods[i], drawn[i] * pass_eyes, i);
+      }
+      end_frame_data(3, ring.commands_offset + scene_commands * sizeof(draw_command));
+      glMultiDrawElementsIndirect(GL_TRIANGLES, arena.index_type,
+                                  (void *) frame_offset(ring.commands_offset), scene_commands, 0);
+   }
+   else {
+      end_frame_data(0, sizeof(frame_data));
+      for (int i = 0; i < 3; i++) {
+         if (drawn[i])
+            draw_gear(*lods[i], m[i]);
+      }
+   }
+
+   fence_frame_data();
+}
+
+/*
+ * Single-pass stereo.  Both eyes are drawn by one pass into the two layers
+ * of a layered framebuffer: every draw has twice the instances, the vertex
+ * shader takes its eye from the low bit of gl_InstanceID and routes it to
+ * gl_Layer, and the instance attributes advance every second instance.
+ * So culling, LOD selection, command building and state changes are done
+ * once per frame rather than once per eye.  The layers are then blitted to
+ * the left and right back buffers, resolving -samples on the way, which is
+ * why the samples move from the visual to the layered framebuffer.
+ * Without gl_Layer in vertex shaders the eyes are drawn one after the
+ * other, each into its own layer when there are samples to keep.
+ * -twopass draws the eyes one after the other into the back buffers.
+ */
+static GLint stereo_samples = 0;        /* -samples, moved to the layered framebuffer */
+
+struct stereo_target {
+   GLuint fbo, color, depth;            /* layered, one layer per eye */
+   GLuint layer_fbo[2];                 /* framebuffers of each layer, with its depth */
+   int width, height;
+};
+
+static thread_local stereo_target stereo_fb;
+
+static void
+delete_stereo_framebuffer(void)
+{
+   glDeleteFramebuffers(1, &stereo_fb.fbo);
+   glDeleteFramebuffers(2, stereo_fb.layer_fbo);
+   glDeleteTextures(1, &stereo_fb.color);
+   glDeleteTextures(1, &stereo_fb.depth);
+   memset(&stereo_fb, 0, sizeof(stereo_fb));
+}
+
+static void
+create_stereo_framebuffer(int width, int height)
+{
+   stereo_fb.width = width;
+   stereo_fb.height = height;
+
+   GLenum target = stereo_samples > 0 ? GL_TEXTURE_2D_MULTISAMPLE_ARRAY : GL_TEXTURE_2D_ARRAY;
+   GLuint textures[2];
+   GLenum formats[2] = { GL_RGBA8, GL_DEPTH_COMPONENT24 };
+   glGenTextures(2, textures);
+   for (int i = 0; i < 2; i++) {
+      glBindTexture(target, textures[i]);
+      if (stereo_samples > 0)
+         glTexImage3DMultisample(target, stereo_samples, formats[i], width, height, 2, GL_TRUE);
+      else
+         glTexStorage3D(target, 1, formats[i], width, height, 2);
+   }
+   glBindTexture(target, 0);
+   stereo_fb.color = textures[0];
+   stereo_fb.depth = textures[1];
+
+   glGenFramebuffers(1, &stereo_fb.fbo);
+   glBindFramebuffer(GL_FRAMEBUFFER, stereo_fb.fbo);
+   glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, stereo_fb.color, 0);
+   glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, stereo_fb.depth, 0);
+   if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      printf("Error: incomplete layered stereo framebuffer\n");
+      exit(1);
+   }
+
+   glGenFramebuffers(2, stereo_fb.layer_fbo);
+   for (int eye = 0; eye < 2; eye++) {
+      glBindFramebuffer(GL_FRAMEBUFFER, stereo_fb.layer_fbo[eye]);
+      glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, stereo_fb.color, 0, eye);
+      glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, stereo_fb.depth, 0, eye);
+   }
+}
+
+/* Redirect drawing to the layered framebuffer, (re)allocated to the window's size. */
+static void
+begin_stereo_frame(void)
+{
+   if (stereo_fb.width != win_width || stereo_fb.height != win_height) {
+      delete_stereo_framebuffer();
+      create_stereo_framebuffer(win_width, win_height);
+   }
+   glBindFramebuffer(GL_FRAMEBUFFER, stereo_fb.fbo);
+}
+
+/* Copy (and resolve) the eyes to the left and right back buffers. */
+static void
+end_stereo_frame(void)
+{
+   static const GLenum back[2] = { GL_BACK_LEFT, GL_BACK_RIGHT };
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+   for (int eye = 0; eye < 2; eye++) {
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, stereo_fb.layer_fbo[eye]);
+      glDrawBuffer(back[eye]);
+      glBlitFramebuffer(0, 0, win_width, win_height, 0, 0, win_width, win_height,
+                        GL_COLOR_BUFFER_BIT, GL_NEAREST);
+   }
+   glBindFramebuffer(GL_FRAMEBUFFER, 0);
+   glDrawBuffer(GL_BACK);
+}
+
+/*
+ * Prepend what the vertex shaders need to know about the eyes to src,
+ * after its #version line: EYE, and with single-pass stereo STEREO and
+ * the extension that lets a vertex shader write gl_Layer.
+ */
+static std::string
+eye_shader(const char *src)
+{
+   const char *line_end = strchr(src, '\n') + 1;
+   std::string prologue = "#define EYE 0\n";
+   if (pass_eyes == 2) {
+      prologue = GLEW_ARB_shader_viewport_layer_array ?
+                 "#extension GL_ARB_shader_viewport_layer_array : require\n" :
+                 "#extension GL_AMD_vertex_shader_layer : require\n";
+      prologue += "#define STEREO\n#define EYE (gl_InstanceID & 1)\n";
+   }
+   return std::string(src, line_end) + prologue + line_end;
+}
+
+static void
+draw_gears(void)
+{
+   glm::mat4 view_projection[2];
+   if (stereo) {
+      view_projection[0] = glm::translate(glm::frustum(left, right, -asp, asp, 5.0f, 60.0f), glm::vec3(0.5 * eyesep, 0.0, -40.0));
+      view_projection[1] = glm::translate(glm::frustum(-right, -left, -asp, asp, 5.0f, 60.0f), glm::vec3(-0.5 * eyesep, 0.0, -40.0));
+   }
+   else {
+      view_projection[0] = glm::translate(glm::frustum(-1.0f, 1.0f, -asp, asp, 5.0f, 60.0f), glm::vec3(0.0, 0.0, -40.0));
+   }
+
+   if (stereo && pass_eyes == 2) {
+      begin_stereo_frame();
+      draw(view_projection);
+      end_stereo_frame();
+   }
+   else if (stereo && stereo_samples > 0) {
+      /* single-pass stereo fell back to two passes, keeping the samples */
+      begin_stereo_frame();
+      for (int eye = 0; eye < 2; eye++) {
+         glBindFramebuffer(GL_FRAMEBUFFER, stereo_fb.layer_fbo[eye]);
+         draw(&view_projection[eye]);
+      }
+      end_stereo_frame();
+   }
+   else if (stereo) {
+      /* First left eye.  */
+      glDrawBuffer(GL_BACK_LEFT);
+      draw(&view_projection[0]);
+
+      /* Then right eye.  */
+      glDrawBuffer(GL_BACK_RIGHT);
+      draw(&view_projection[1]);
+   }
+   else {
+      draw(&view_projection[0]);
+   }
+}
+
+
+/*
+ * Per-frame samples (in milliseconds) of one reporting interval, reported
+ * as min/p50/p95/p99/max so stutter shows up instead of vanishing in the
+ * average.
+ */
+struct time_stats {
+   size_t count;
+   double min, p50, p95, p99, max;
+};
+
+struct frame_times {
+   std::vector<double> samples;
+
+   void add(double ms) { samples.push_back(ms); }
+
+   double percentile(double p) const
+   {
+      /* samples are sorted by summarize() before this is used */
+      size_t i = (size_t) ceil(p * samples.size());
+      return samples[i > 0 ? i - 1 : 0];
+   }
+
+   /* Summarize and start over for the next interval. */
+   time_stats summarize()
+   {
+      time_stats stats = { samples.size(), 0.0, 0.0, 0.0, 0.0, 0.0 };
+      if (!samples.empty()) {
+         std::sort(samples.begin(), samples.end());
+         stats.min = samples.front();
+         stats.p50 = percentile(0.50);
+         stats.p95 = percentile(0.95);
+         stats.p99 = percentile(0.99);
+         stats.max = samples.back();
+      }
+      samples.clear();
+      return stats;
+   }
+};
+
+static void
+print_time_stats(const char *name, const time_stats &stats)
+{
+   if (stats.count == 0)
+      return;
+   printf("  %-9s min %7.3f  p50 %7.3f  p95 %7.3f  p99 %7.3f  max %7.3f  (%zu frames)\n",
+          name, stats.min, stats.p50, stats.p95, stats.p99, stats.max, stats.count);
+}
+
+/*
+ * GPU frame time from GL_TIME_ELAPSED queries.  A ring of query objects
+ * lets results arrive a few frames late; they are only collected once
+ * GL_QUERY_RESULT_AVAILABLE says so, so reading them never stalls.  A frame
+ * whose query is still pending when its slot comes round again is dropped.
+ */
+static const int gpu_query_count = 8;
+
+struct gpu_timer {
+   GLuint queries[gpu_query_count];
+   GLboolean pending[gpu_query_count];
+   int next;                            /* slot of the next frame */
+   int oldest;                          /* oldest slot that may be pending */
+   int dropped;
+   GLboolean active;                    /* a query is open this frame */
+   double last_ms;                      /* latest result, 0 before the first */
+};
+
+static thread_local gpu_timer gpu_timer;
+static thread_local frame_times cpu_frame_times, gpu_frame_times;
+
+static void
+gpu_timer_collect(void)
+{
+   while (gpu_timer.pending[gpu_timer.oldest]) {
+      GLuint query = gpu_timer.queries[gpu_timer.oldest];
+      GLint available = 0;
+      glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available)
+         break;
+      GLuint64 ns;
+      glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+      gpu_timer.last_ms = ns / 1000000.0;
+      gpu_frame_times.add(gpu_timer.last_ms);
+      gpu_timer.pending[gpu_timer.oldest] = GL_FALSE;
+      gpu_timer.oldest = (gpu_timer.oldest + 1) % gpu_query_count;
+   }
+}
+
+/*
+ * The first frame pays for one-time driver work (shader compilation, lazy
+ * uploads) and is left out, like its CPU frame time.
+ */
+static void
+gpu_timer_begin(void)
+{
+   if (!gpu_timer.queries[0]) {
+      glGenQueries(gpu_query_count, gpu_timer.queries);
+      return;
+   }
+
+   gpu_timer_collect();
+   if (gpu_timer.pending[gpu_timer.next]) {
+      gpu_timer.pending[gpu_timer.next] = GL_FALSE;
+      gpu_timer.oldest = (gpu_timer.next + 1) % gpu_query_count;
+      gpu_timer.dropped++;
+   }
+   glBeginQuery(GL_TIME_ELAPSED, gpu_timer.queries[gpu_timer.next]);
+   gpu_timer.active = GL_TRUE;
+}
+
+static void
+gpu_timer_end(void)
+{
+   if (!gpu_timer.active)
+      return;
+   glEndQuery(GL_TIME_ELAPSED);
+   gpu_timer.active = GL_FALSE;
+   gpu_timer.pending[gpu_timer.next] = GL_TRUE;
+   gpu_timer.next = (gpu_timer.next + 1) % gpu_query_count;
+}
+
+
+/*
+ * Frames in flight (-frames-in-flight N).  Every submitted frame gets a
+ * fence; once N frames are unfinished the CPU waits for the oldest before
+ * starting the next one, so at most N frames are queued no matter how
+ * deep the driver's queue is.  The time from submission (the swap) to the
+ * fence signalling is each frame's latency.  Completion is noticed when
+ * the fence is polled after a submission or waited for, so it is an
+ * upper bound.
+ *
+ * The frame ring also waits for the frame that used its segment last,
+ * so limits above frame_ring_size have no effect.
+ */
+static const int max_frames_in_flight = 16;
+
+struct flight_queue {
+   GLsync fences[max_frames_in_flight];
+   double submitted[max_frames_in_flight];
+   int oldest;
+   int count;
+};
+
+static thread_local flight_queue flight;
+static thread_local frame_times latency_times;
+
+/* Retire finished frames, waiting for the oldest while more than keep
+ * are unfinished. */
+static void
+retire_frames(int keep)
+{
+   while (flight.count > 0) {
+      GLsync fence = flight.fences[flight.oldest];
+      GLuint64 timeout = flight.count > keep ? 1000000000 : 0;
+      if (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout) == GL_TIMEOUT_EXPIRED) {
+         if (flight.count > keep)
+            continue;
+         break;
+      }
+      latency_times.add((current_time() - flight.submitted[flight.oldest]) * 1000.0);
+      glDeleteSync(fence);
+      flight.oldest = (flight.oldest + 1) % max_frames_in_flight;
+      flight.count--;
+   }
+}
+
+/* Called after the frame was submitted at time t. */
+static void
+submit_frame(double t)
+{
+   int i = (flight.oldest + flight.count) % max_frames_in_flight;
+   flight.fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   flight.submitted[i] = t;
+   flight.count++;
+   retire_frames(frames_in_flight - 1);
+}
+
+static void
+delete_flight_queue(void)
+{
+   for (; flight.count > 0; flight.count--) {
+      glDeleteSync(flight.fences[flight.oldest]);
+      flight.oldest = (flight.oldest + 1) % max_frames_in_flight;
+   }
+}
+
+
+/* Context and framebuffer of -offscreen, see make_offscreen_context(). */
+struct offscreen_target {
+   EGLDisplay egl_dpy;
+   EGLConfig egl_config;
+   EGLContext egl_ctx;
+   EGLSurface egl_surface;
+   Display *dpy;                        /* GLX fallback */
+   GLXFBConfig config;
+   GLXPbuffer pbuffer;
+   GLXContext ctx;
+   GLuint fbo, color, depth;
+   int width, height;
+};
+
+static thread_local offscreen_target target;
+
+/*
+ * Golden image verification (-golden DIR).  At each checkpoint frame the
+ * rendered image is read back and compared with DIR/frameNNNNN.ppm by
+ * checksum and PSNR.  A missing golden image fails, as does a checkpoint
+ * the run never reached; -golden-record writes the images instead, which
+ * is how a set gets recorded.  Runs are only repeatable with -fixed-step.
+ */
+static const int max_checkpoints = 64;
+static int checkpoints[max_checkpoints];
+static bool checkpoint_reached[max_checkpoints];
+static int num_checkpoints = 0;
+static int golden_failures = 0;
+
+/* Whether frame is a checkpoint, which is then marked as reached. */
+static GLboolean
+is_checkpoint(int frame)
+{
+   GLboolean found = GL_FALSE;
+   for (int i = 0; i < num_checkpoints; i++) {
+      if (checkpoints[i] == frame) {
+         checkpoint_reached[i] = true;
+         found = GL_TRUE;
+      }
+   }
+   return found;
+}
+
+/* Count the checkpoints the run ended before as failures. */
+static void
+check_checkpoints_reached(void)
+{
+   for (int i = 0; i < num_checkpoints; i++) {
+      if (!checkpoint_reached[i]) {
+         printf("frame %d: FAIL, the run ended after %d frames\n", checkpoints[i], frames_drawn);
+         golden_failures++;
+      }
+   }
+}
+
+/* Make the frame just drawn the source of glReadPixels. */
+static void
+select_read_buffer(int width, int height)
+{
+   static GLuint resolve_fbo, resolve_rb;
+
+   if (offscreen && samples > 0) {
+      if (!resolve_fbo) {
+         glGenRenderbuffers(1, &resolve_rb);
+         glBindRenderbuffer(GL_RENDERBUFFER, resolve_rb);
+         glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+         glGenFramebuffers(1, &resolve_fbo);
+         glBindFramebuffer(GL_FRAMEBUFFER, resolve_fbo);
+         glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, resolve_rb);
+      }
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolve_fbo);
+      glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, resolve_fbo);
+   }
+   else if (!offscreen) {
+      glReadBuffer(stereo ? GL_BACK_LEFT : GL_BACK);
+   }
+}
+
+/* Read the frame just drawn as top-down RGB. */
+static void
+read_frame(std::vector<unsigned char> &rgb, int width, int height)
+{
+   std::vector<unsigned char> rows(width * height * 3);
+
+   select_read_buffer(width, height);
+   glPixelStorei(GL_PACK_ALIGNMENT, 1);
+   glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, rows.data());
+   if (offscreen)
+      glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+
+   rgb.resize(rows.size());
+   for (int y = 0; y < height; y++)
+      memcpy(&rgb[y * width * 3], &rows[(height - 1 - y) * width * 3], width * 3);
+}
+
+static GLboolean
+read_ppm(const char *path, std::vector<unsigned char> &rgb, int &width, int &height)
+{
+   FILE *f = fopen(path, "rb");
+   int maxval;
+   if (!f)
+      return GL_FALSE;
+   if (fscanf(f, "P6 %d %d %d", &width, &height, &maxval) != 3 || maxval != 255 ||
+       fgetc(f) == EOF) {
+      fclose(f);
+      return GL_FALSE;
+   }
+   rgb.resize(width * height * 3);
+   size_t n = fread(rgb.data(), 1, rgb.size(), f);
+   fclose(f);
+   return n == rgb.size();
+}
+
+static GLboolean
+write_ppm(const char *path, const std::vector<unsigned char> &rgb, int width, int height)
+{
+   FILE *f = fopen(path, "wb");
+   if (!f)
+      return GL_FALSE;
+   fprintf(f, "P6\n%d %d\n255\n", width, height);
+   size_t n = fwrite(rgb.data(), 1, rgb.size(), f);
+   return fclose(f) == 0 && n == rgb.size();
+}
+
+/* FNV-1a over the pixels */
+static unsigned long long
+image_checksum(const std::vector<unsigned char> &rgb)
+{
+   return hash_bytes(fnv1a_basis, rgb.data(), rgb.size());
+}
+
+static double
+image_psnr(const std::vector<unsigned char> &a, const std::vector<unsigned char> &b)
+{
+   double sum = 0.0;
+   for (size_t i = 0; i < a.size(); i++) {
+      double d = (double) a[i] - b[i];
+      sum += d * d;
+   }
+   if (sum == 0.0)
+      return INFINITY;
+   return 10.0 * log10(255.0 * 255.0 * a.size() / sum);
+}
+
+static void
+check_golden(int frame)
+{
+   std::vector<unsigned char> rgb, golden;
+   int width, height;
+   char path[4096];
+
+   read_frame(rgb, win_width, win_height);
+   snprintf(path, sizeof(path), "%s/frame%05d.ppm", golden_dir, frame);
+
+   if (golden_record) {
+      if (write_ppm(path, rgb, win_width, win_height))
+         printf("frame %d: checksum %016llx, recorded %s\n", frame, image_checksum(rgb), path);
+      else {
+         printf("frame %d: couldn't write %s\n", frame, path);
+         golden_failures++;
+      }
+      return;
+   }
+
+   if (!read_ppm(path, golden, width, height)) {
+      printf("frame %d: FAIL, no golden image %s (record one with -golden-record)\n",
+             frame, path);
+      golden_failures++;
+      return;
+   }
+
+   if (width != win_width || height != win_height) {
+      printf("frame %d: FAIL, %dx%d but golden image is %dx%d\n",
+             frame, win_width, win_height, width, height);
+      golden_failures++;
+      return;
+   }
+
+   unsigned long long sum = image_checksum(rgb);
+   double psnr = image_psnr(rgb, golden);
+   GLboolean pass = psnr >= min_psnr;
+   printf("frame %d: checksum %016llx (%s), PSNR %.2f dB, %s\n", frame, sum,
+          sum == image_checksum(golden) ? "exact" : "differs", psnr,
+          pass ? "pass" : "FAIL");
+   if (!pass)
+      golden_failures++;
+}
+
+
+/*
+ * Frame capture (-capture DIR).  glReadPixels into a pixel pack buffer
+ * returns without waiting for the frame, so every frame is read into the
+ * next free buffer of a ring and fenced.  Once its fence has signalled,
+ * polled at later frames, the buffer goes to a writer thread, which
+ * flips and converts the pixels and writes DIR/frameNNNNN.ppm, or appends
+ * to DIR/capture.rgb (raw top-down RGB) or DIR/capture.y4m (4:2:0).
+ * With GL_ARB_buffer_storage the buffers stay mapped and the writer reads
+ * them in place; otherwise the render thread maps and copies them out.
+ * The render thread never waits: when the next buffer is still being
+ * read or written, that frame is dropped.  Its time in capture_frame() is
+ * reported as the capture overhead.
+ */
+enum capture_format { CAPTURE_PPM, CAPTURE_RAW, CAPTURE_Y4M };
+static const char *const capture_format_names[] = { "ppm", "raw", "y4m" };
+
+static const char *capture_dir = NULL;  /* -capture */
+static capture_format capture_fmt = CAPTURE_PPM; /* -capture-format */
+static const int capture_ring_size = 6;
+
+struct capture_slot {
+   GLuint pbo;
+   unsigned char *map;                  /* persistent mapping, or NULL */
+   GLsync fence;                        /* of the pending read */
+   bool writing;                        /* owned by the writer thread */
+   int frame;
+   int width, height;                   /* of the read, and the buffer */
+};
+
+/* A frame on its way to disk: bottom-up RGBA as read. */
+struct captured_frame {
+   int frame;
+   int width, height;
+   int slot;                            /* whose mapping pixels points into, or -1 */
+   const unsigned char *pixels;
+   std::vector<unsigned char> copy;     /* without a persistent mapping */
+};
+
+struct frame_capture {
+   capture_slot slots[capture_ring_size];
+   int next;                            /* slot of the next read */
+   int oldest;                          /* slot of the oldest pending read */
+   int pending;
+   std::thread writer;
+   std::mutex lock;                     /* guards the queue, spare, done and slot.writing */
+   std::condition_variable wake;
+   std::deque<captured_frame> queue;
+   std::vector<std::vector<unsigned char>> spare; /* copy buffers to reuse */
+   bool done;
+   FILE *stream;                        /* raw and y4m */
+   int stream_width, stream_height;
+   int dropped;                         /* render thread */
+   int written, resized;                /* writer thread */
+   std::atomic<int> failed;
+   double bytes, write_seconds;         /* writer thread */
+};
+
+static frame_capture capture;
+static thread_local frame_times capture_times;
+
+/* Top-down RGB of a captured frame. */
+static void
+flip_captured_frame(const captured_frame &f, std::vector<unsigned char> &rgb)
+{
+   rgb.resize(f.width * f.height * 3);
+   for (int y = 0; y < f.height; y++) {
+      const unsigned char *src = f.pixels + (f.height - 1 - y) * f.width * 4;
+      unsigned char *dst = &rgb[y * f.width * 3];
+      for (int x = 0; x < f.width; x++, src += 4, dst += 3) {
+         dst[0] = src[0];
+         dst[1] = src[1];
+         dst[2] = src[2];
+      }
+   }
+}
+
+/* One YUV4MPEG2 frame, full range BT.601 with chroma averaged over 2x2 pixels. */
+static GLboolean
+write_y4m_frame(FILE *f, const std::vector<unsigned char> &rgb, int width, int height,
+                size_t &bytes)
+{
+   int cw = (width + 1) / 2, ch = (height + 1) / 2;
+   std::vector<unsigned char> yuv(width * height + 2 * cw * ch);
+   unsigned char *luma = yuv.data(), *cb = luma + width * height, *cr = cb + cw * ch;
+
+   for (int i = 0; i < width * height; i++) {
+      const unsigned char *p = &rgb[i * 3];
+      luma[i] = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+   }
+   for (int cy = 0; cy < ch; cy++) {
+      for (int cx = 0; cx < cw; cx++) {
+         int r = 0, g = 0, b = 0, n = 0;
+         for (int y = 2 * cy; y < 2 * cy + 2 && y < height; y++) {
+            for (int x = 2 * cx; x < 2 * cx + 2 && x < width; x++, n++) {
+               const unsigned char *p = &rgb[(y * width + x) * 3];
+               r += p[0];
+               g += p[1];
+               b += p[2];
+            }
+         }
+         r /= n;
+         g /= n;
+         b /= n;
+         cb[cy * cw + cx] = (-43 * r - 85 * g + 128 * b + 32895) >> 8;
+         cr[cy * cw + cx] = (128 * r - 107 * g - 21 * b + 32895) >> 8;
+      }
+   }
+   bytes = yuv.size();
+   return fputs("FRAME\n", f) >= 0 && fwrite(yuv.data(), 1, yuv.size(), f) == yuv.size();
+}
+
+static GLboolean
+write_captured_frame(const captured_frame &f, std::vector<unsigned char> &rgb, size_t &bytes)
+{
+   flip_captured_frame(f, rgb);
+   bytes = rgb.size();
+   if (capture_fmt == CAPTURE_PPM) {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s/frame%05d.ppm", capture_dir, f.frame);
+      return write_ppm(path, rgb, f.width, f.height);
+   }
+
+   /* streams keep the size of their first frame */
+   if (!capture.stream) {
+      const char *name = capture_fmt == CAPTURE_Y4M ? "capture.y4m" : "capture.rgb";
+      std::string path = std::string(capture_dir) + "/" + name;
+      capture.stream = fopen(path.c_str(), "wb");
+      if (!capture.stream)
+         return GL_FALSE;
+      capture.stream_width = f.width;
+      capture.stream_height = f.height;
+      if (capture_fmt == CAPTURE_Y4M)
+         fprintf(capture.stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+                 f.width, f.height, target_fps > 0 ? target_fps : 60);
+   }
+   if (f.width != capture.stream_width || f.height != capture.stream_height) {
+      capture.resized++;
+      bytes = 0;
+      return GL_TRUE;
+   }
+   if (capture_fmt == CAPTURE_Y4M)
+      return write_y4m_frame(capture.stream, rgb, f.width, f.height, bytes);
+   return fwrite(rgb.data(), 1, rgb.size(), capture.stream) == rgb.size();
+}
+
+static void
+capture_writer(void)
+{
+   std::vector<unsigned char> rgb;
+
+   for (;;) {
+      captured_frame f;
+      {
+         std::unique_lock<std::mutex> lock(capture.lock);
+         capture.wake.wait(lock, [] { return capture.done || !capture.queue.empty(); });
+         if (capture.queue.empty())
+            return;
+         f = std::move(capture.queue.front());
+         capture.queue.pop_front();
+      }
+
+      double t0 = current_time();
+      size_t bytes;
+      if (!write_captured_frame(f, rgb, bytes)) {
+         capture.failed++;
+      }
+      else if (bytes > 0) {
+         capture.written++;
+         capture.bytes += bytes;
+      }
+      capture.write_seconds += current_time() - t0;
+
+      std::lock_guard<std::mutex> lock(capture.lock);
+      if (f.slot >= 0)
+         capture.slots[f.slot].writing = false;
+      else
+         capture.spare.push_back(std::move(f.copy));
+   }
+}
+
+static void
+start_capture(void)
+{
+   mkdir(capture_dir, 0755);
+   capture.writer = std::thread(capture_writer);
+}
+
+/* (Re)allocate the buffer of a free slot for reads of width x height. */
+static void
+resize_capture_slot(capture_slot &s, int width, int height)
+{
+   GLsizeiptr size = width * height * 4;
+
+   glDeleteBuffers(1, &s.pbo);
+   glGenBuffers(1, &s.pbo);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+   if (GLEW_ARB_buffer_storage) {
+      GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NULL, flags);
+      s.map = (unsigned char *) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags);
+   }
+   else {
+      glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+      s.map = NULL;
+   }
+   s.width = width;
+   s.height = height;
+}
+
+/* Hand the oldest pending read to the writer, once it is done or when wait is set. */
+static GLboolean
+collect_capture(GLboolean wait)
+{
+   capture_slot &s = capture.slots[capture.oldest];
+   GLuint64 timeout = wait ? 1000000000 : 0;
+   if (glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout) == GL_TIMEOUT_EXPIRED)
+      return GL_FALSE;
+   glDeleteSync(s.fence);
+   s.fence = 0;
+   capture.oldest = (capture.oldest + 1) % capture_ring_size;
+   capture.pending--;
+
+   captured_frame f;
+   f.frame = s.frame;
+   f.width = s.width;
+   f.height = s.height;
+   if (s.map) {
+      f.slot = &s - capture.slots;
+      f.pixels = s.map;
+   }
+   else {
+      {
+         std::lock_guard<std::mutex> lock(capture.lock);
+         if (!capture.spare.empty()) {
+            f.copy = std::move(capture.spare.back());
+            capture.spare.pop_back();
+         }
+      }
+      f.slot = -1;
+      f.copy.resize(s.width * s.height * 4);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+      void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, f.copy.size(), GL_MAP_READ_BIT);
+      if (pixels) {
+         memcpy(f.copy.data(), pixels, f.copy.size());
+         glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      if (!pixels) {
+         capture.failed++;
+         return GL_TRUE;
+      }
+      f.pixels = f.copy.data();
+   }
+
+   std::lock_guard<std::mutex> lock(capture.lock);
+   s.writing = f.slot >= 0;
+   capture.queue.push_back(std::move(f));
+   capture.wake.notify_one();
+   return GL_TRUE;
+}
+
+/* Start reading back the frame just drawn. */
+static void
+capture_frame(void)
+{
+   double t0 = current_time();
+
+   while (capture.pending > 0 && collect_capture(GL_FALSE))
+      ;
+
+   capture_slot &s = capture.slots[capture.next];
+   bool writing;
+   {
+      std::lock_guard<std::mutex> lock(capture.lock);
+      writing = s.writing;
+   }
+   if (s.fence || writing) {
+      capture.dropped++;
+      capture_times.add((current_time() - t0) * 1000.0);
+      return;
+   }
+
+   if (s.width != win_width || s.height != win_height)
+      resize_capture_slot(s, win_width, win_height);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+   select_read_buffer(s.width, s.height);
+   glReadPixels(0, 0, s.width, s.height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   if (offscreen)
+      glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+   s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   s.frame = frames_drawn;
+   capture.next = (capture.next + 1) % capture_ring_size;
+   capture.pending++;
+
+   capture_times.add((current_time() - t0) * 1000.0);
+}
+
+/* Write the frames still in the ring and wait for the writer. */
+static void
+finish_capture(void)
+{
+   while (capture.pending > 0)
+      collect_capture(GL_TRUE);
+   {
+      std::lock_guard<std::mutex> lock(capture.lock);
+      capture.done = true;
+      capture.wake.notify_one();
+   }
+   capture.writer.join();
+   if (capture.stream && fclose(capture.stream) != 0)
+      capture.failed++;
+   capture.stream = NULL;
+   for (int i = 0; i < capture_ring_size; i++)
+      glDeleteBuffers(1, &capture.slots[i].pbo);
+
+   printf("capture: %d frames, %.1f MB written to %s, %.2f ms each on the writer thread\n",
+          capture.written, capture.bytes / (1024.0 * 1024.0), capture_dir,
+          capture.written ? capture.write_seconds * 1000.0 / capture.written : 0.0);
+   if (capture.dropped + capture.resized + capture.failed > 0)
+      printf("  (%d dropped with no free buffer, %d for their size, %d failed)\n",
+             capture.dropped, capture.resized, capture.failed.load());
+}
+
+
+/*
+ * Frame pacing (-fps N).  Instead of spinning on XPending() the loop
+ * sleeps in poll() on the X connection and a timerfd that expires at
+ * every frame's deadline, handles events as they arrive and draws when
+ * the timer fires.  How late each frame starts after its deadline is its
+ * jitter; deadlines that passed without a frame are counted as missed.
+ *
+ * Independently of pacing, the thread CPU time used from one frame to
+ * the next ("cpu use", including event handling and waiting) is recorded,
+ * which shows what spinning costs.
+ */
+struct frame_pacer {
+   int fd;
+   double start, period;
+   uint64_t ticks;                      /* deadlines since start */
+   int missed;
+};
+
+static thread_local frame_pacer pacer;
+static thread_local frame_times cpu_use_times, jitter_times;
+static thread_local frame_times scale_samples; /* -dynres render_scale, percent */
+
+static void
+start_pacer(void)
+{
+   pacer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+   if (pacer.fd < 0) {
+      printf("Error: timerfd_create failed\n");
+      exit(1);
+   }
+   pacer.period = 1.0 / target_fps;
+   pacer.start = current_time();
+   pacer.ticks = 0;
+
+   /* absolute, so the schedule does not drift */
+   struct itimerspec spec;
+   double first = pacer.start + pacer.period;
+   spec.it_value.tv_sec = (time_t) first;
+   spec.it_value.tv_nsec = (long) ((first - (time_t) first) * 1000000000.0);
+   spec.it_interval.tv_sec = (time_t) pacer.period;
+   spec.it_interval.tv_nsec = (long) ((pacer.period - (time_t) pacer.period) * 1000000000.0);
+   timerfd_settime(pacer.fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void
+stop_pacer(void)
+{
+   close(pacer.fd);
+   pacer.fd = -1;
+}
+
+/*
+ * Sleep until the next deadline or until fd (if not -1) is readable.
+ * Returns GL_TRUE at a deadline, after recording its jitter when draw is set.
+ */
+static GLboolean
+wait_pacer(int fd, GLboolean draw)
+{
+   struct pollfd fds[2] = { { pacer.fd, POLLIN, 0 }, { fd, POLLIN, 0 } };
+   if (poll(fds, fd >= 0 ? 2 : 1, -1) <= 0 || !(fds[0].revents & POLLIN))
+      return GL_FALSE;
+
+   uint64_t expirations;
+   if (read(pacer.fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+      return GL_FALSE;
+   pacer.ticks += expirations;
+   if (draw) {
+      pacer.missed += expirations - 1;
+      double deadline = pacer.start + pacer.ticks * pacer.period;
+      jitter_times.add((current_time() - deadline) * 1000.0);
+   }
+   return GL_TRUE;
+}
+
+
+/*
+ * One reporting interval: printed as it ends and kept for -report.
+ */
+struct interval_record {
+   int window;
+   int frames;
+   double seconds;
+   double fps;
+   time_stats cpu, gpu, latency, cpu_use, jitter, scale, capture;
+   int gpu_dropped;
+   int missed;                          /* -fps deadlines skipped */
+   lod_stats lod;                       /* per frame */
+   cull_stats cull;                     /* per frame */
+};
+
+static std::vector<interval_record> intervals;
+static std::mutex intervals_mutex;      /* guards intervals and their printing */
+static thread_local int interval_frames = 0;
+static thread_local double interval_start = -1.0;
+
+static void
+end_interval(double t)
+{
+   interval_record r;
+   r.window = window_index;
+   r.frames = interval_frames;
+   r.seconds = t - interval_start;
+   r.fps = r.frames / r.seconds;
+   r.cpu = cpu_frame_times.summarize();
+   r.gpu = gpu_frame_times.summarize();
+   r.latency = latency_times.summarize();
+   r.cpu_use = cpu_use_times.summarize();
+   r.jitter = jitter_times.summarize();
+   r.scale = scale_samples.summarize();
+   r.capture = capture_times.summarize();
+   r.missed = pacer.missed;
+   r.gpu_dropped = gpu_timer.dropped;
+   r.lod = lod_counts;
+   for (int i = 0; i < gear_lods; i++)
+      r.lod.gears[i] /= r.frames;
+   r.lod.triangles /= r.frames;
+   r.lod.full_triangles /= r.frames;
+   r.cull.visible = cull_counts.visible / r.frames;
+   r.cull.culled = cull_counts.culled / r.frames;
+
+   std::lock_guard<std::mutex> lock(intervals_mutex);
+   intervals.push_back(r);
+
+   if (num_windows > 1)
+      printf("window %d: ", r.window);
+   printf("%d frames in %3.1f seconds = %6.3f FPS\n", r.frames, r.seconds,
+          r.fps);
+   print_time_stats("frame ms:", r.cpu);
+   print_time_stats("gpu ms:", r.gpu);
+   print_time_stats("latency:", r.latency);
+   print_time_stats("cpu use:", r.cpu_use);
+   print_time_stats("jitter:", r.jitter);
+   print_time_stats("scale %:", r.scale);
+   print_time_stats("capture:", r.capture);
+   if (r.missed > 0)
+      printf("  (%d frame deadlines missed)\n", r.missed);
+   if (r.gpu_dropped > 0)
+      printf("  (%d gpu timings dropped)\n", r.gpu_dropped);
+   if (use_lod && r.lod.full_triangles > 0.0)
+      printf("  lod:      %.0f/%.0f/%.0f gears, %.0f of %.0f triangles per frame (%.1f%%)\n",
+             r.lod.gears[0], r.lod.gears[1], r.lod.gears[2], r.lod.triangles,
+             r.lod.full_triangles, 100.0 * r.lod.triangles / r.lod.full_triangles);
+   if (r.cull.visible + r.cull.culled > 0.0)
+      printf("  culling:  %.0f gears visible, %.0f culled per frame\n",
+             r.cull.visible, r.cull.culled);
+   fflush(stdout);
+
+   memset(&lod_counts, 0, sizeof(lod_counts));
+   memset(&cull_counts, 0, sizeof(cull_counts));
+   gpu_timer.dropped = 0;
+   pacer.missed = 0;
+   interval_start = t;
+   interval_frames = 0;
+}
+
+/* Report whatever the last, partial interval collected. */
+static void
+finish_intervals(void)
+{
+   if (interval_frames == 0)
+      return;
+   glFinish();
+   gpu_timer_collect();
+   retire_frames(0);
+   end_interval(current_time());
+}
+
+/*
+ * Dynamic resolution (-dynres MS).  draw_gears() renders into a
+ * framebuffer of the window's size, multisampled with -samples, but only
+ * into a viewport of render_scale times the window; that is resolved at
+ * the scaled size and one linear glBlitFramebuffer scales it up to the
+ * window.  At full scale without samples the frame goes straight to the
+ * window instead.  After every frame the scale follows the render cost
+ * towards the budget: the latest GPU timer result or, if more, the CPU
+ * time from the start of the frame to its submission.  Neither includes
+ * the -fps sleep or waiting for vsync, which a lower resolution could not
+ * shorten.  Pixel cost goes with the area, so the scale moves by the
+ * square root of budget / cost, smoothed and limited to a few percent per
+ * frame.
+ */
+static double dynres_budget = 0.0;      /* -dynres: render cost budget in ms */
+static GLint dynres_samples = 0;        /* -samples, moved to the scaled framebuffer */
+static const GLfloat dynres_min_scale = 0.25f;
+
+struct dynamic_resolution {
+   GLuint fbo, color, depth;
+   GLuint resolve_fbo, resolve_color;   /* with samples */
+   int width, height;                   /* allocated size: the window's */
+   bool direct;                         /* this frame is drawn to the window */
+   double cost_ms;                      /* smoothed render cost */
+};
+
+static thread_local dynamic_resolution dynres;
+
+static void
+delete_dynres_framebuffer(void)
+{
+   glDeleteFramebuffers(1, &dynres.fbo);
+   glDeleteRenderbuffers(1, &dynres.color);
+   glDeleteRenderbuffers(1, &dynres.depth);
+   glDeleteFramebuffers(1, &dynres.resolve_fbo);
+   glDeleteRenderbuffers(1, &dynres.resolve_color);
+   dynres.fbo = dynres.color = dynres.depth = 0;
+   dynres.resolve_fbo = dynres.resolve_color = 0;
+}
+
+static void
+create_dynres_framebuffer(int width, int height)
+{
+   dynres.width = width;
+   dynres.height = height;
+
+   glGenRenderbuffers(1, &dynres.color);
+   glBindRenderbuffer(GL_RENDERBUFFER, dynres.color);
+   glRenderbufferStorageMultisample(GL_RENDERBUFFER, dynres_samples, GL_RGBA8, width, height);
+   glGenRenderbuffers(1, &dynres.depth);
+   glBindRenderbuffer(GL_RENDERBUFFER, dynres.depth);
+   glRenderbufferStorageMultisample(GL_RENDERBUFFER, dynres_samples, GL_DEPTH_COMPONENT24,
+                                    width, height);
+   glGenFramebuffers(1, &dynres.fbo);
+   glBindFramebuffer(GL_FRAMEBUFFER, dynres.fbo);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, dynres.color);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, dynres.depth);
+   if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      printf("Error: incomplete dynamic resolution framebuffer\n");
+      exit(1);
+   }
+
+   if (dynres_samples > 0) {
+      glGenRenderbuffers(1, &dynres.resolve_color);
+      glBindRenderbuffer(GL_RENDERBUFFER, dynres.resolve_color);
+      glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+      glGenFramebuffers(1, &dynres.resolve_fbo);
+      glBindFramebuffer(GL_FRAMEBUFFER, dynres.resolve_fbo);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER,
+                                dynres.resolve_color);
+   }
+}
+
+static void
+scaled_size(int &width, int &height)
+{
+   width = (int) (win_width * render_scale + 0.5f);
+   height = (int) (win_height * render_scale + 0.5f);
+   if (width < 1)
+      width = 1;
+   if (height < 1)
+      height = 1;
+}
+
+/* Redirect drawing to the scaled viewport of the dynamic resolution framebuffer. */
+static void
+begin_dynres_frame(void)
+{
+   dynres.direct = render_scale == 1.0f && dynres_samples == 0;
+   if (dynres.direct)
+      return;
+   if (dynres.width != win_width || dynres.height != win_height) {
+      delete_dynres_framebuffer();
+      create_dynres_framebuffer(win_width, win_height);
+   }
+   int width, height;
+   scaled_size(width, height);
+   glBindFramebuffer(GL_FRAMEBUFFER, dynres.fbo);
+   glViewport(0, 0, width, height);
+   /* glClear ignores the viewport */
+   glScissor(0, 0, width, height);
+   glEnable(GL_SCISSOR_TEST);
+}
+
+/* Resolve and scale the frame up to the window (or offscreen target). */
+static void
+end_dynres_frame(void)
+{
+   if (dynres.direct)
+      return;
+   GLuint present = offscreen ? target.fbo : 0;
+   int width, height;
+   scaled_size(width, height);
+
+   glDisable(GL_SCISSOR_TEST);
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, dynres.fbo);
+   if (dynres.resolve_fbo) {
+      /* resolving only the scaled pixels is cheaper than a scaled resolve */
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dynres.resolve_fbo);
+      glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, dynres.resolve_fbo);
+   }
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, present);
+   glBlitFramebuffer(0, 0, width, height, 0, 0, win_width, win_height, GL_COLOR_BUFFER_BIT,
+                     GL_LINEAR);
+   glBindFramebuffer(GL_FRAMEBUFFER, present);
+   glViewport(0, 0, win_width, win_height);
+}
+
+static void
+update_render_scale(double cost_ms)
+{
+   scale_samples.add(render_scale * 100.0);
+   dynres.cost_ms = dynres.cost_ms > 0.0 ? 0.8 * dynres.cost_ms + 0.2 * cost_ms : cost_ms;
+
+   double ratio = dynres_budget / dynres.cost_ms;
+   if (ratio > 0.95 && ratio < 1.05)
+      return;
+   double step = sqrt(ratio);
+   step = step < 0.9 ? 0.9 : step > 1.03 ? 1.03 : step;
+   render_scale *= step;
+   if (render_scale < dynres_min_scale)
+      render_scale = dynres_min_scale;
+   if (render_scale > 1.0f)
+      render_scale = 1.0f;
+}
+
+/** Draw single frame, do SwapBuffers, compute FPS */
+static void
+draw_frame(Display *dpy, Window win)
+{
+   static thread_local double tRot0 = -1.0, cpu0;
+   double dt, t = current_time(), cpu = thread_cpu_time();
+
+   if (tRot0 < 0.0)
+      tRot0 = t;
+   dt = t - tRot0;
+   tRot0 = t;
+   if (frames_drawn > 0) {
+      cpu_frame_times.add(dt * 1000.0);
+      cpu_use_times.add((cpu - cpu0) * 1000.0);
+   }
+   cpu0 = cpu;
+
+   if (animate) {
+      /* advance rotation for next frame */
+      if (fixed_step)
+         angle += 70.0 / 60.0;  /* 70 degrees per second at 60 Hz */
+      else
+         angle += 70.0 * dt;  /* 70 degrees per second */
+      if (angle > 3600.0)
+         angle -= 3600.0;
+   }
+
+   gpu_timer_begin();
+   if (dynres_budget > 0.0)
+      begin_dynres_frame();
+   draw_gears();
+   if (dynres_budget > 0.0)
+      end_dynres_frame();
+   gpu_timer_end();
+   frames_drawn++;
+   if (dynres_budget > 0.0 && frames_drawn > 1) {
+      double submit_ms = (current_time() - t) * 1000.0;
+      update_render_scale(submit_ms > gpu_timer.last_ms ? submit_ms : gpu_timer.last_ms);
+   }
+
+   /* The first frame's GPU work and swap are finished separately so the
+    * profile shows what each costs. */
+   GLboolean first = startup_profile && frames_drawn == 1 && window_index == 0;
+   if (first) {
+      startup_mark("first frame (cpu)");
+      glFinish();
+      startup_mark("first frame (gpu)");
+   }
+
+   if (golden_dir && is_checkpoint(frames_drawn))
+      check_golden(frames_drawn);
+   if (capture_dir)
+      capture_frame();
+   double submitted = current_time();
+   if (offscreen)
+      glFlush();
+   else
+      glXSwapBuffers(dpy, win);
+
+   if (first) {
+      glFinish();
+      startup_mark(offscreen ? "first flush" : "first swap");
+      print_startup_profile();
+   }
+   if (frames_in_flight > 0)
+      submit_frame(submitted);
+
+   interval_frames++;
+
+   if (interval_start < 0.0)
+      interval_start = t;
+   if (t - interval_start >= 5.0)
+      end_interval(t);
+}
+
+
+/* new window size or exposure */
+static void
+reshape(int width, int height)
+{
+   GLfloat w = fix_point * (1.0 / 5.0);
+   glViewport(0, 0, (GLint) width, (GLint) height);
+   win_width = width;
+   win_height = height;
+
+   asp = (GLfloat) height / (GLfloat) width;
+   left = -5.0 * ((w - 0.5 * eyesep) / fix_point);
+   right = 5.0 * ((w + 0.5 * eyesep) / fix_point);
+}
+   
+static const char vertexShader[] =
+"#version 330 core\n"
+"#extension GL_ARB_separate_shader_objects : enable\n"
+"layout(location = 0) in vec3 position;\n"
+"layout(location = 1) in vec3 normal;\n"
+"uniform vec3 color;\n"
+"uniform mat4 m;\n"
+"layout(std140) uniform frame { mat4 vp[2]; float angle; };\n"
+"layout(location = 0) out vec4 vs_position;\n"
+"layout(location = 1) out vec3 vs_normal;\n"
+"layout(location = 2) out vec3 vs_color;\n"
+"void main(){\n"
+"  vs_position = m * vec4(position, 1);\n"
+"  gl_Position = vp[EYE] * vs_position;\n"
+"#ifdef STEREO\n"
+"  gl_Layer = EYE;\n"
+"#endif\n"
+"  vs_normal = normalize(mat3(m) * normal);\n"
+"  vs_color = color;\n"
+"}\n"
+;
+
+static const char indirectVertexShader[] =
+"#version 430 core\n"
+"#extension GL_ARB_shader_draw_parameters : require\n"
+"layout(location = 0) in vec3 position;\n"
+"layout(location = 1) in vec3 normal;\n"
+"struct draw_data { mat4 m; vec4 color; };\n"
+"layout(std430, binding = 0) readonly buffer draws { draw_data draw[]; };\n"
+"layout(std140, binding = 0) uniform frame { mat4 vp[2]; float angle; };\n"
+"layout(location = 0) out vec4 vs_position;\n"
+"layout(location = 1) out vec3 vs_normal;\n"
+"layout(location = 2) out vec3 vs_color;\n"
+"void main(){\n"
+"  mat4 m = draw[gl_DrawIDARB].m;\n"
+"  vs_position = m * vec4(position, 1);\n"
+"  gl_Position = vp[EYE] * vs_position;\n"
+"#ifdef STEREO\n"
+"  gl_Layer = EYE;\n"
+"#endif\n"
+"  vs_normal = normalize(mat3(m) * normal);\n"
+"  vs_color = draw[gl_DrawIDARB].color.rgb;\n"
+"}\n"
+;
+
+static const char fieldVertexShader[] =
+"#version 330 core\n"
+"#extension GL_ARB_separate_shader_objects : enable\n"
+"layout(location = 0) in vec3 position;\n"
+"layout(location = 1) in vec3 normal;\n"
+"layout(location = 3) in vec4 instance;\n" // x, y, cos, sin
+"layout(location = 4) in vec3 instance_color;\n"
+"layout(std140) uniform frame { mat4 vp[2]; float angle; };\n"
+"layout(location = 0) out vec4 vs_position;\n"
+"layout(location = 1) out vec3 vs_normal;\n"
+"layout(location = 2) out vec3 vs_color;\n"
+"void main(){\n"
+"  mat2 r = mat2(instance.z, instance.w, -instance.w, instance.z);\n"
+"  vs_position = vec4(r * position.xy + instance.xy, position.z, 1);\n"
+"  gl_Position = vp[EYE] * vs_position;\n"
+"#ifdef STEREO\n"
+"  gl_Layer = EYE;\n"
+"#endif\n"
+"  vs_normal = normalize(vec3(r * normal.xy, normal.z));\n"
+"  vs_color = instance_color;\n"
+"}\n"
+;
+
+/*
+ * -procedural: no vertex buffer.  Vertex i of a non-indexed draw is corner
+ * i % tooth_indices of tooth i / tooth_indices; the corner's slot comes
+ * from tooth_triangles (slots from 32 on are the next tooth's) and the
+ * shader computes the slot's position and normal the way gear_tooth()
+ * does.  The gear's parameters are uniforms, so changing them costs
+ * nothing.
+ */
+static std::string
+procedural_vertex_shader(void)
+{
+   std::string table;
+   for (int i = 0; i < tooth_indices; i++)
+      table += (i ? ", " : "") + std::to_string(tooth_triangles[i]);
+
+   return
+"#version 330 core\n"
+"#extension GL_ARB_separate_shader_objects : enable\n"
+"uniform vec3 color;\n"
+"uniform mat4 m;\n"
+"uniform vec4 shape;\n" // inner radius, outer radius, width, tooth depth
+"uniform int teeth;\n"
+"layout(std140) uniform frame { mat4 vp[2]; float angle; };\n"
+"layout(location = 0) out vec4 vs_position;\n"
+"layout(location = 1) out vec3 vs_normal;\n"
+"layout(location = 2) out vec3 vs_color;\n"
+"const int tooth_triangles[" + std::to_string(tooth_indices) + "] = int[](" + table + ");\n"
+"int tooth;\n"
+"vec2 polar(float r, int j){\n"
+"  float a = float((tooth * 4 + j) % (teeth * 4)) * (6.28318530717958648 / float(teeth * 4));\n"
+"  return r * vec2(cos(a), sin(a));\n"
+"}\n"
+"void main(){\n"
+"  tooth = gl_VertexID / " + std::to_string(tooth_indices) + ";\n"
+"  int slot = tooth_triangles[gl_VertexID % " + std::to_string(tooth_indices) + "];\n"
+"  if (slot >= 32) {\n"
+"    tooth = (tooth + 1) % teeth;\n"
+"    slot -= 32;\n"
+"  }\n"
+"  float r0 = shape.x, r1 = shape.y - shape.w / 2.0, r2 = shape.y + shape.w / 2.0;\n"
+"  float hw = shape.z * 0.5;\n"
+"  vec3 p, n;\n"
+"  if (slot < 10) {\n" // front and back faces
+"    int k = slot % 5;\n"
+"    float r = k == 0 ? r0 : k < 3 ? r1 : r2;\n"
+"    p = vec3(polar(r, k < 2 ? 0 : k == 2 ? 3 : k - 2), slot < 5 ? hw : -hw);\n"
+"    n = vec3(0, 0, slot < 5 ? 1.0 : -1.0);\n"
+"  }\n"
+"  else if (slot < 26) {\n" // outward faces: quad q spans quarter steps q and q + 1
+"    int q = (slot - 10) / 4, k = (slot - 10) % 4;\n"
+"    vec2 a = polar(q == 1 || q == 2 ? r2 : r1, q);\n"
+"    vec2 b = polar(q < 2 ? r2 : r1, q + 1);\n"
+"    p = vec3(k < 2 ? a : b, k == 0 || k == 3 ? hw : -hw);\n"
+"    vec2 d = b - a;\n"
+"    n = vec3((q & 1) == 0 ? normalize(vec2(d.y, -d.x)) : polar(1.0, q == 1 ? 0 : 4), 0);\n"
+"  }\n"
+"  else {\n" // inside radius cylinder
+"    vec2 a = polar(1.0, 0);\n"
+"    p = vec3(r0 * a, slot == 26 ? -hw : hw);\n"
+"    n = vec3(-a, 0);\n"
+"  }\n"
+"  vs_position = m * vec4(p, 1);\n"
+"  gl_Position = vp[EYE] * vs_position;\n"
+"#ifdef STEREO\n"
+"  gl_Layer = EYE;\n"
+"#endif\n"
+"  vs_normal = normalize(mat3(m) * n);\n"
+"  vs_color = color;\n"
+"}\n";
+}
+
+/*
+ * -gpucull: every field instance that survives the frustum test is
+ * animated and appended, with an atomic, to the region of
+ * visible_instances reserved for its mesh and level of detail; the
+ * bucket's instance_count is the atomic counter.
+ */
+static std::string
+cull_compute_shader(void)
+{
+   std::string types = std::to_string(max_field_types);
+
+   return
+"#version 430 core\n"
+"layout(local_size_x = 64) in;\n"
+"layout(std140) uniform frame { mat4 vp[2]; float angle; float pixels_per_unit; };\n"
+"struct instance { float x, y, phase, ratio, r, g, b; };\n"
+"struct animated { float x, y, c, s, r, g, b; };\n"
+"struct command { uint count, instance_count, first_index; int base_vertex; uint base_instance; };\n"
+"layout(std430, binding = 1) readonly buffer instances { instance all_instances[]; };\n"
+"layout(std430, binding = 2) writeonly buffer visible_instances { animated visible[]; };\n"
+"layout(std430, binding = 3) buffer buckets { command bucket[]; };\n"
+"uniform uint total, types;\n"
+"uniform uint first[" + types + "];\n"
+"uniform float bound[" + types + "], radius[" + types + "];\n"
+"uniform vec2 lod_pixels;\n"
+"uniform float lod_bias;\n"
+"uniform bool cull, lod;\n"
+"uniform int eyes;\n"
+"void main(){\n"
+"  uint i = gl_GlobalInvocationID.x;\n"
+"  if (i >= total)\n"
+"    return;\n"
+"  uint type = 0u;\n"
+"  while (type + 1u < types && i >= first[type + 1u])\n"
+"    type++;\n"
+"  vec4 c = vec4(all_instances[i].x, all_instances[i].y, 0, 1);\n"
+"  bool inside = !cull;\n"
+"  for (int e = 0; e < eyes && !inside; e++) {\n"
+"    mat4 rows = transpose(vp[e]);\n"
+"    inside = true;\n"
+"    for (int p = 0; p < 6; p++) {\n"
+"      vec4 plane = rows[3] + ((p & 1) != 0 ? -rows[p / 2] : rows[p / 2]);\n"
+"      if (dot(plane, c) < -bound[type] * length(plane.xyz))\n"
+"        inside = false;\n"
+"    }\n"
+"  }\n"
+"  if (!inside)\n"
+"    return;\n"
+"  mat4 rows = transpose(vp[0]);\n" // the eyes only differ in x
+"  uint l = 0u;\n"
+"  float w = dot(rows[3], c);\n"
+"  if (lod && w > 0.0) {\n"
+"    float pixels = radius[type] * pixels_per_unit * lod_bias / w;\n"
+"    l = pixels < lod_pixels.y ? 2u : pixels < lod_pixels.x ? 1u : 0u;\n"
+"  }\n"
+"  uint b = type * " + std::to_string(gear_lods) + "u + l;\n"
+"  uint slot = atomicAdd(bucket[b].instance_count, 1u);\n"
+"  instance g = all_instances[i];\n"
+"  float a = radians(mod(g.ratio * angle + g.phase, 360.0));\n"
+"  visible[bucket[b].base_instance + slot] = animated(g.x, g.y, cos(a), sin(a), g.r, g.g, g.b);\n"
+"}\n";
+}
+
+/* Copy the non-empty buckets to the draw commands, one instance per eye, and reset them. */
+static std::string
+compact_compute_shader(void)
+{
+   std::string buckets = std::to_string(field_buckets);
+
+   return
+"#version 430 core\n"
+"layout(local_size_x = 1) in;\n"
+"uniform uint eyes;\n"
+"struct command { uint count, instance_count, first_index; int base_vertex; uint base_instance; };\n"
+"layout(std430, binding = 3) buffer buckets { command bucket[" + buckets + "]; };\n"
+"layout(std430, binding = 4) buffer draws { uint draw_count; uint pad[3]; command draw[" + buckets + "]; };\n"
+"void main(){\n"
+"  uint n = 0u;\n"
+"  for (int b = 0; b < " + buckets + "; b++) {\n"
+"    if (bucket[b].instance_count > 0u) {\n"
+"      draw[n] = bucket[b];\n"
+"      draw[n++].instance_count *= eyes;\n"
+"    }\n"
+"    bucket[b].instance_count = 0u;\n"
+"  }\n"
+"  draw_count = n;\n"
+"  for (uint i = n; i < " + buckets + "u; i++)\n"
+"    draw[i].instance_count = 0u;\n"
+"}\n";
+}
+
+static const char fragmentShader[] =
+"#version 330 core\n"
+"#extension GL_ARB_separate_shader_objects : enable\n"
+"layout(location = 0) in vec4 vs_position;\n"
+"layout(location = 1) in vec3 vs_normal;\n"
+"layout(location = 2) in vec3 vs_color;\n"
+"uniform vec3 light_position;\n"
+"out vec4 color;\n"
+"void main(){\n"
+//"  vec3 light_vector = normalize(light_position - (vs_position.xyz / vs_position.w));\n" // Point light
+"  vec3 light_vector = normalize(light_position);\n" // Directional light
+"  vec3 middle = (light_vector + vs_normal) / 2;\n" // I can't recall *why* this does a thing, but this approximates OG glxgears results.
+"  float dp = dot(middle, vs_normal);\n"
+"  float v = max(dp, 0.0);\n"
+"  color = v * vec4(vs_color, 1.0);\n"
+"}\n"
+;
+
+static void checkShaderError(GLuint shader) {
+	int InfoLogLength;  
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if ( InfoLogLength > 0 ){
+		std::vector<char> VertexShaderErrorMessage(InfoLogLength+1);
+		glGetShaderInfoLog(shader, InfoLogLength, NULL, VertexShaderErrorMessage.data());
+		printf("%s\n", VertexShaderErrorMessage.data());
+	}
+}
+
+/* Without a fragment shader, vertexShaderSource is a compute shader. */
+static GLuint
+compile_program(const char *vertexShaderSource, const char *fragmentShaderSource)
+{
+   GLuint fs = 0;
+   if (fragmentShaderSource) {
+      fs = glCreateShader(GL_FRAGMENT_SHADER);
+      glShaderSource(fs, 1, &fragmentShaderSource, NULL);
+      glCompileShader(fs);
+
+      checkShaderError(fs);
+   }
+
+   GLuint vs = glCreateShader(fragmentShaderSource ? GL_VERTEX_SHADER : GL_COMPUTE_SHADER);
+   glShaderSource(vs, 1, &vertexShaderSource, NULL);
+   glCompileShader(vs);
+
+   checkShaderError(vs);
+
+   GLuint program = glCreateProgram();
+   if (program_cache)
+      glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+   glAttachShader(program, vs);
+   if (fs)
+      glAttachShader(program, fs);
+   glLinkProgram(program);
+
+   glDetachShader(program, vs);
+   glDeleteShader(vs);
+   if (fs) {
+      glDetachShader(program, fs);
+      glDeleteShader(fs);
+   }
+
+   return program;
+}
+
+/*
+ * Program binary cache.  Linked programs are saved with glGetProgramBinary
+ * in a file named after a hash of both shader sources, GL_RENDERER and
+ * GL_VERSION, and later runs load them with glProgramBinary.  A binary
+ * the driver rejects (after a driver update, say) is compiled from source
+ * again and replaced.
+ */
+struct program_binary_header {
+   char magic[4];                       /* "GPB1" */
+   GLenum format;
+   GLint length;
+};
+
+static int programs_cached = 0, programs_compiled = 0;
+static double program_seconds = 0.0;    /* spent in build_program() */
+
+/* Path of the cache entry for these sources, or "" without a cache. */
+static std::string
+program_cache_path(const char *vertexShaderSource, const char *fragmentShaderSource)
+{
+   GLint formats = 0;
+   if (!program_cache || !GLEW_ARB_get_program_binary)
+      return "";
+   glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+   if (formats == 0)
+      return "";
+   std::string dir = cache_directory();
+   if (dir.empty())
+      return "";
+
+   uint64_t h = fnv1a_basis;
+   h = hash_string(h, vertexShaderSource);
+   h = hash_string(h, fragmentShaderSource);
+   h = hash_string(h, (const char *) glGetString(GL_RENDERER));
+   h = hash_string(h, (const char *) glGetString(GL_VERSION));
+
+   char name[32];
+   snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long) h);
+   return dir + name;
+}
+
+/* A program from the cache, or 0 if there is none or GL rejects it. */
+static GLuint
+load_program_binary(const std::string &path)
+{
+   FILE *f = fopen(path.c_str(), "rb");
+   if (!f)
+      return 0;
+
+   /* the binary is the rest of the file, so a damaged length can't allocate past it */
+   struct stat st;
+   program_binary_header header;
+   std::vector<char> binary;
+   if (fstat(fileno(f), &st) == 0 && fread(&header, sizeof(header), 1, f) == 1 &&
+       memcmp(header.magic, "GPB1", 4) == 0 && header.length > 0 &&
+       (off_t) header.length == st.st_size - (off_t) sizeof(header)) {
+      binary.resize(header.length);
+      if (fread(binary.data(), 1, binary.size(), f) != binary.size())
+         binary.clear();
+   }
+   fclose(f);
+   if (binary.empty())
+      return 0;
+
+   GLuint program = glCreateProgram();
+   glProgramBinary(program, header.format, binary.data(), binary.size());
+   GLint linked = GL_FALSE;
+   glGetProgramiv(program, GL_LINK_STATUS, &linked);
+   if (!linked) {
+      glDeleteProgram(program);
+      return 0;
+   }
+   return program;
+}
+
+static void
+save_program_binary(GLuint program, const std::string &path)
+{
+   GLint length = 0;
+   glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+   if (length <= 0)
+      return;
+
+   program_binary_header header = { { 'G', 'P', 'B', '1' }, 0, 0 };
+   std::vector<char> binary(length);
+   glGetProgramBinary(program, length, &header.length, &header.format, binary.data());
+
+   /* write and rename, so a concurrent run never reads half a file */
+   std::string tmp = path + ".tmp";
+   FILE *f = fopen(tmp.c_str(), "wb");
+   if (!f)
+      return;
+   GLboolean ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                  fwrite(binary.data(), 1, header.length, f) == (size_t) header.length;
+   if (fclose(f) == 0 && ok)
+      rename(tmp.c_str(), path.c_str());
+   else
+      remove(tmp.c_str());
+}
+
+static GLuint
+build_program(const char *vertexShaderSource, const char *fragmentShaderSource)
+{
+   double t0 = current_time();
+   std::string path = program_cache_path(vertexShaderSource, fragmentShaderSource);
+
+   GLuint program = path.empty() ? 0 : load_program_binary(path);
+   if (program) {
+      programs_cached++;
+   }
+   else {
+      program = compile_program(vertexShaderSource, fragmentShaderSource);
+      programs_compiled++;
+      if (!path.empty())
+         save_program_binary(program, path);
+   }
+
+   GLuint frame = glGetUniformBlockIndex(program, "frame");
+   if (frame != GL_INVALID_INDEX)
+      glUniformBlockBinding(program, frame, 0);
+
+   program_seconds += current_time() - t0;
+   return program;
+}
+
+/*
+ * Bound the instances, grouped by mesh with field.types, field.mesh and
+ * field.count set, and fit a field extent units across into view.
+ */
+static void
+finish_field(GLfloat extent)
+{
+   GLsizei first = 0;
+   for (int type = 0; type < field.types; type++) {
+      field.first[type] = first;
+      first += field.count[type];
+   }
+   field.spheres.resize(field.instances.size());
+   field.animation.resize(field.instances.size());
+   for (int type = 0; type < field.types; type++) {
+      for (GLsizei i = field.first[type]; i < field.first[type] + field.count[type]; i++) {
+         const gear_instance &inst = field.instances[i];
+         field.spheres.set(i, inst.position[0], inst.position[1], 0.0f, field.mesh[type].bound);
+         field.animation.set(i, inst.position[0], inst.position[1], inst.phase, inst.ratio);
+      }
+   }
+   field.scale = extent > 14.0f ? 14.0f / extent : 1.0f;
+   field_gears = field.instances.size();
+
+   startup_mark("gear field");
+
+   field.program = build_program(eye_shader(fieldVertexShader).c_str(), fragmentShader);
+}
+
+/*
+ * Lay out n gears on a grid with 4.1 units between neighbours, which is
+ * how far apart two of the 10 tooth gears mesh.  With tooth centers 13.5
+ * degrees past each tooth's start, two neighbours turning in opposite
+ * directions mesh when their phases add up to 27 degrees (mod 36).
+ */
+static void
+build_field(GLint n)
+{
+   const GLfloat spacing = 4.1;
+   GLint cols = (GLint) ceil(sqrt((double) n));
+   GLint rows = (n + cols - 1) / cols;
+   std::vector<gear_instance> instances[2];
+
+   field.types = 2;
+   field.mesh[0] = gear2;
+   field.mesh[1] = gear3;
+   for (GLint i = 0; i < n; i++) {
+      GLint row = i / cols, col = i % cols;
+      int type = (row + col) & 1;
+      /* cheap hash for a little brightness variation */
+      GLuint h = (GLuint) i * 2654435761u;
+      GLfloat shade = 0.7f + 0.3f * (GLfloat) (h >> 24) / 255.0f;
+      gear_instance inst;
+      inst.position[0] = (col - 0.5f * (cols - 1)) * spacing;
+      inst.position[1] = (row - 0.5f * (rows - 1)) * spacing;
+      inst.phase = type ? 27.0f : 0.0f;
+      inst.ratio = type ? -1.0f : 1.0f;
+      for (int c = 0; c < 3; c++)
+         inst.color[c] = field.mesh[type].color[c] * shade;
+      instances[type].push_back(inst);
+   }
+
+   field.count[0] = instances[0].size();
+   field.count[1] = instances[1].size();
+   field.instances = instances[0];
+   field.instances.insert(field.instances.end(), instances[1].begin(), instances[1].end());
+   finish_field((cols > rows ? cols : rows) * spacing);
+}
+
+/*
+ * Scene files (-scene FILE): the field as up to max_field_types gear
+ * shapes and any number of gears, instead of the grid.  As text:
+ *
+ *    # comment
+ *    shape NAME INNER OUTER WIDTH TEETH DEPTH R G B
+ *    gear SHAPE X Y [ratio R] [phase DEGREES] [color R G B]
+ *    mesh SHAPE PARENT ANGLE [color R G B]
+ *
+ * A gear turns ratio (default 1) times as fast as the animation.  "mesh"
+ * puts a gear where it engages gear number PARENT (counting from 0 in
+ * file order), ANGLE degrees around it, and derives its speed ratio and
+ * phase from the parent's.  Colors default to the shape's.  The text is
+ * parsed in one pass straight out of a read-only mapping.
+ *
+ * -save-scene FILE writes the field (a scene or the -gears grid) in the
+ * binary form: a header, the shapes with their gear counts, then the
+ * instances grouped by shape just as the field keeps them, so loading it
+ * is one copy.  Files are told apart by the binary magic.
+ */
+static const char *scene_file = NULL;   /* -scene */
+static const char *save_scene_file = NULL; /* -save-scene */
+
+static const GLint max_scene_teeth = 100000; /* keeps a bad file from exhausting memory */
+
+static const char scene_magic[8] = { 'G', 'E', 'A', 'R', 'S', 'C', 'N', '\n' };
+static const GLuint scene_version = 1;
+
+struct scene_header {
+   char magic[8];
+   GLuint version;
+   GLuint types;
+   uint64_t gears;
+};
+
+struct scene_shape {
+   GLfloat inner_radius, outer_radius, width, tooth_depth;
+   GLint teeth;
+   GLfloat color[3];
+   uint64_t count;                      /* gears of this shape */
+};
+
+/*
+ * Place gear b, of shape sb, angle degrees around gear a so that their
+ * teeth engage.  Along the line between them, a's teeth pass by at ratio
+ * * teeth tooth periods per turn of the animation, and b's must come the
+ * other way as fast; they engage where a tooth center (3/8 of a period
+ * past the tooth's start) of one meets a gap center of the other.
+ */
+static void
+engage_gear(const gear_instance &a, const gear_mesh &sa, const gear_mesh &sb, GLfloat angle,
+            gear_instance &b)
+{
+   GLfloat distance = sa.shape[1] + sb.shape[1] + 0.1f;
+   b.position[0] = a.position[0] + distance * cosf(angle / degrees_per_rad);
+   b.position[1] = a.position[1] + distance * sinf(angle / degrees_per_rad);
+   b.ratio = -a.ratio * sa.teeth / sb.teeth;
+
+   GLfloat period_a = 360.0f / sa.teeth, period_b = 360.0f / sb.teeth;
+   GLfloat contact_a = (angle - a.phase) / period_a - 0.375f;  /* in a's periods */
+   b.phase = fmodf(angle + 180.0f - period_b * (0.875f - contact_a), period_b);
+}
+
+/* Position in a text scene, and where to report errors. */
+struct scene_parser {
+   const char *p, *end;
+   const char *path;
+   int line;
+};
+
+static bool
+scene_error(const scene_parser &s, const char *message)
+{
+   printf("Error: %s:%d: %s\n", s.path, s.line, message);
+   return false;
+}
+
+static void
+skip_blanks(scene_parser &s)
+{
+   while (s.p < s.end && (*s.p == ' ' || *s.p == '\t' || *s.p == '\r'))
+      s.p++;
+}
+
+/* True at the end of the line, a comment or the file. */
+static bool
+scene_line_end(scene_parser &s)
+{
+   skip_blanks(s);
+   return s.p == s.end || *s.p == '\n' || *s.p == '#';
+}
+
+static void
+next_scene_line(scene_parser &s)
+{
+   const char *nl = (const char *) memchr(s.p, '\n', s.end - s.p);
+   s.p = nl ? nl + 1 : s.end;
+   s.line++;
+}
+
+static bool
+scene_word(scene_parser &s, const char *&word, size_t &len)
+{
+   if (scene_line_end(s))
+      return false;
+   word = s.p;
+   while (s.p < s.end && *s.p != ' ' && *s.p != '\t' && *s.p != '\r' && *s.p != '\n')
+      s.p++;
+   len = s.p - word;
+   return true;
+}
+
+static bool
+is_word(const char *word, size_t len, const char *str)
+{
+   return strlen(str) == len && memcmp(word, str, len) == 0;
+}
+
+/* [-]digits[.digits][e[-]digits]; the mapping has no terminating NUL for strtod */
+static bool
+scene_number(scene_parser &s, GLfloat &value)
+{
+   skip_blanks(s);
+   const char *p = s.p;
+   bool negative = p < s.end && *p == '-';
+   if (p < s.end && (*p == '-' || *p == '+'))
+      p++;
+   double v = 0.0;
+   int digits = 0;
+   for (; p < s.end && *p >= '0' && *p <= '9'; p++, digits++)
+      v = v * 10.0 + (*p - '0');
+   if (p < s.end && *p == '.') {
+      double scale = 0.1;
+      for (p++; p < s.end && *p >= '0' && *p <= '9'; p++, digits++, scale *= 0.1)
+         v += (*p - '0') * scale;
+   }
+   if (digits == 0)
+      return false;
+   if (p < s.end && (*p == 'e' || *p == 'E')) {
+      int exponent = 0, sign = 1;
+      p++;
+      if (p < s.end && (*p == '-' || *p == '+'))
+         sign = *p++ == '-' ? -1 : 1;
+      for (; p < s.end && *p >= '0' && *p <= '9'; p++)
+         exponent = exponent * 10 + (*p - '0');
+      v *= pow(10.0, sign * exponent);
+   }
+   if (p < s.end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#')
+      return false;
+   s.p = p;
+   value = negative ? -v : v;
+   return true;
+}
+
+static bool
+scene_numbers(scene_parser &s, GLfloat *values, int n)
+{
+   for (int i = 0; i < n; i++) {
+      if (!scene_number(s, values[i]))
+         return false;
+   }
+   return true;
+}
+
+/* Whether a shape from a scene file makes a gear; teeth is checked to be integral. */
+static bool
+valid_scene_shape(GLfloat inner_radius, GLfloat outer_radius, GLfloat width, GLfloat teeth,
+                  GLfloat tooth_depth)
+{
+   return inner_radius >= 0.0f && outer_radius > inner_radius && isfinite(outer_radius) &&
+          width >= 0.0f && isfinite(width) && tooth_depth >= 0.0f && isfinite(tooth_depth) &&
+          teeth >= 1.0f && teeth <= max_scene_teeth && teeth == floorf(teeth);
+}
+
+static bool
+parse_scene_text(scene_parser &s)
+{
+   std::vector<std::string> names;
+   std::vector<gear_instance> gears;    /* in file order */
+   std::vector<unsigned char> types;
+
+   for (; s.p < s.end; next_scene_line(s)) {
+      const char *word;
+      size_t len;
+      if (!scene_word(s, word, len))
+         continue;
+
+      if (is_word(word, len, "shape")) {
+         const char *name;
+         size_t name_len;
+         GLfloat v[8];
+         if (!scene_word(s, name, name_len) || !scene_numbers(s, v, 8) || !scene_line_end(s))
+            return scene_error(s, "expected shape NAME INNER OUTER WIDTH TEETH DEPTH R G B");
+         if (field.types == max_field_types)
+            return scene_error(s, "too many shapes");
+         if (!valid_scene_shape(v[0], v[1], v[2], v[3], v[4]))
+            return scene_error(s, "not a gear shape");
+         names.push_back(std::string(name, name_len));
+         field.mesh[field.types++] = gear(v[0], v[1], v[2], (GLint) v[3], v[4], v[5], v[6], v[7]);
+         continue;
+      }
+
+      bool engaged = is_word(word, len, "mesh");
+      if (!engaged && !is_word(word, len, "gear"))
+         return scene_error(s, "expected shape, gear or mesh");
+
+      const char *name;
+      size_t name_len;
+      if (!scene_word(s, name, name_len))
+         return scene_error(s, "expected a shape name");
+      int type = 0;
+      while (type < field.types && !is_word(name, name_len, names[type].c_str()))
+         type++;
+      if (type == field.types)
+         return scene_error(s, "unknown shape");
+
+      gear_instance inst;
+      memcpy(inst.color, field.mesh[type].color, sizeof(inst.color));
+      if (engaged) {
+         GLfloat v[2];
+         if (!scene_numbers(s, v, 2))
+            return scene_error(s, "expected mesh SHAPE PARENT ANGLE");
+         if (!(v[0] >= 0.0f && v[0] < gears.size() && v[0] == floorf(v[0])))
+            return scene_error(s, "no such parent gear");
+         size_t parent = (size_t) v[0];
+         engage_gear(gears[parent], field.mesh[types[parent]], field.mesh[type], v[1], inst);
+      }
+      else {
+         if (!scene_numbers(s, inst.position, 2))
+            return scene_error(s, "expected gear SHAPE X Y");
+         inst.ratio = 1.0f;
+         inst.phase = 0.0f;
+      }
+
+      while (scene_word(s, word, len)) {
+         if (!engaged && is_word(word, len, "ratio") && scene_number(s, inst.ratio))
+            continue;
+         if (!engaged && is_word(word, len, "phase") && scene_number(s, inst.phase))
+            continue;
+         if (is_word(word, len, "color") && scene_numbers(s, inst.color, 3))
+            continue;
+         return scene_error(s, "expected ratio, phase or color");
+      }
+      gears.push_back(inst);
+      types.push_back(type);
+   }
+
+   /* group by shape */
+   memset(field.count, 0, sizeof(field.count));
+   for (unsigned char type : types)
+      field.count[type]++;
+   GLsizei next[max_field_types];
+   for (int type = 0, first = 0; type < field.types; first += field.count[type++])
+      next[type] = first;
+   field.instances.resize(gears.size());
+   for (size_t i = 0; i < gears.size(); i++)
+      field.instances[next[types[i]]++] = gears[i];
+   return true;
+}
+
+static bool
+load_scene_binary(const char *path, const char *data, size_t size)
+{
+   scene_header header;
+   memcpy(&header, data, sizeof(header));
+   size_t instances_offset = sizeof(header) + header.types * sizeof(scene_shape);
+   if (header.version != scene_version || header.types > (GLuint) max_field_types ||
+       size < instances_offset ||
+       header.gears > (size - instances_offset) / sizeof(gear_instance) ||
+       size - instances_offset != header.gears * sizeof(gear_instance)) {
+      printf("Error: %s: not a version %u scene or truncated\n", path, scene_version);
+      return false;
+   }
+
+   uint64_t total = 0;
+   for (GLuint type = 0; type < header.types; type++) {
+      scene_shape shape;
+      memcpy(&shape, data + sizeof(header) + type * sizeof(shape), sizeof(shape));
+      if (!valid_scene_shape(shape.inner_radius, shape.outer_radius, shape.width,
+                             (GLfloat) shape.teeth, shape.tooth_depth)) {
+         printf("Error: %s: not a gear shape\n", path);
+         return false;
+      }
+      field.mesh[type] = gear(shape.inner_radius, shape.outer_radius, shape.width, shape.teeth,
+                              shape.tooth_depth, shape.color[0], shape.color[1], shape.color[2]);
+      /* each count is bounded first, so the sum cannot wrap around */
+      if (shape.count > header.gears)
+         break;
+      field.count[type] = shape.count;
+      total += shape.count;
+   }
+   if (total != header.gears) {
+      printf("Error: %s: shape counts do not add up\n", path);
+      return false;
+   }
+   field.types = header.types;
+   field.instances.resize(header.gears);
+   memcpy(field.instances.data(), data + instances_offset, header.gears * sizeof(gear_instance));
+   return true;
+}
+
+/* Load the scene's shapes and instances; the meshes are generated with the others. */
+static bool
+load_scene(const char *path)
+{
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      printf("Error: couldn't open %s\n", path);
+      return false;
+   }
+   struct stat st;
+   void *map = MAP_FAILED;
+   if (fstat(fd, &st) == 0 && st.st_size > 0)
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      printf("Error: couldn't map %s\n", path);
+      return false;
+   }
+   madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+   double t0 = current_time();
+   const char *data = (const char *) map;
+   bool ok;
+   if ((size_t) st.st_size >= sizeof(scene_header) &&
+       memcmp(data, scene_magic, sizeof(scene_magic)) == 0) {
+      ok = load_scene_binary(path, data, st.st_size);
+   }
+   else {
+      scene_parser s = { data, data + st.st_size, path, 1 };
+      ok = parse_scene_text(s);
+   }
+   munmap(map, st.st_size);
+   if (ok && field.instances.empty()) {
+      printf("Error: %s has no gears\n", path);
+      ok = false;
+   }
+   if (ok && printInfo)
+      printf("scene %s: %d shapes, %zu gears in %.2f ms\n", path, field.types,
+             field.instances.size(), (current_time() - t0) * 1000.0);
+   startup_mark("scene");
+   return ok;
+}
+
+/* Fit the loaded scene into view, around the origin. */
+static void
+build_scene_field(void)
+{
+   GLfloat extent = 0.0f, radius = 0.0f;
+   for (const gear_instance &inst : field.instances) {
+      extent = std::max(extent, fabsf(inst.position[0]));
+      extent = std::max(extent, fabsf(inst.position[1]));
+   }
+   for (int type = 0; type < field.types; type++)
+      radius = std::max(radius, field.mesh[type].radius);
+   finish_field(2.0f * (extent + radius));
+}
+
+static bool
+save_scene(const char *path)
+{
+   scene_header header;
+   memcpy(header.magic, scene_magic, sizeof(header.magic));
+   header.version = scene_version;
+   header.types = field.types;
+   header.gears = field.instances.size();
+
+   FILE *f = fopen(path, "wb");
+   if (!f) {
+      printf("Error: couldn't write %s\n", path);
+      return false;
+   }
+   bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+   for (int type = 0; type < field.types; type++) {
+      const gear_mesh &g = field.mesh[type];
+      scene_shape shape;
+      shape.inner_radius = g.shape[0];
+      shape.outer_radius = g.shape[1];
+      shape.width = g.shape[2];
+      shape.tooth_depth = g.shape[3];
+      shape.teeth = g.teeth;
+      memcpy(shape.color, g.color, sizeof(shape.color));
+      shape.count = field.count[type];
+      ok = ok && fwrite(&shape, sizeof(shape), 1, f) == 1;
+   }
+   ok = ok && fwrite(field.instances.data(), sizeof(gear_instance), field.instances.size(), f) ==
+              field.instances.size();
+   if (fclose(f) != 0 || !ok) {
+      printf("Error: couldn't write %s\n", path);
+      return false;
+   }
+   return true;
+}
+
+/*
+ * Shared part of -gpucull: the field's instances as a storage buffer and
+ * the two compute programs, whose uniforms never change.
+ */
+static void
+init_gpu_cull(void)
+{
+   glGenBuffers(1, &field.instance_buffer);
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, field.instance_buffer);
+   glBufferData(GL_SHADER_STORAGE_BUFFER, field.instances.size() * sizeof(gear_instance),
+                field.instances.data(), GL_STATIC_DRAW);
+
+   field.cull_program = build_program(cull_compute_shader().c_str(), NULL);
+   field.compact_program = build_program(compact_compute_shader().c_str(), NULL);
+
+   GLuint p = field.cull_program;
+   GLuint first[max_field_types];
+   GLfloat bound[max_field_types], radius[max_field_types];
+   for (int type = 0; type < field.types; type++) {
+      first[type] = field.first[type];
+      bound[type] = field.mesh[type].bound;
+      radius[type] = field.mesh[type].radius;
+   }
+   glUseProgram(p);
+   glUniform1ui(glGetUniformLocation(p, "total"), field.instances.size());
+   glUniform1ui(glGetUniformLocation(p, "types"), field.types);
+   glUniform1uiv(glGetUniformLocation(p, "first"), field.types, first);
+   glUniform1fv(glGetUniformLocation(p, "bound"), field.types, bound);
+   glUniform1fv(glGetUniformLocation(p, "radius"), field.types, radius);
+   glUniform2fv(glGetUniformLocation(p, "lod_pixels"), 1, lod_pixels);
+   glUniform1f(glGetUniformLocation(p, "lod_bias"), lod_bias);
+   glUniform1i(glGetUniformLocation(p, "cull"), use_cull);
+   glUniform1i(glGetUniformLocation(p, "lod"), use_lod);
+   glUniform1i(glGetUniformLocation(p, "eyes"), pass_eyes);
+   glUseProgram(field.compact_program);
+   glUniform1ui(glGetUniformLocation(field.compact_program, "eyes"), pass_eyes);
+   startup_mark("gpu culling");
+}
+
+/* Per-context buffers and bindings of -gpucull. */
+static void
+init_gpu_cull_context(void)
+{
+   draw_command buckets[field_buckets];
+   memset(buckets, 0, sizeof(buckets));
+   for (int b = 0; b < field.types * gear_lods; b++) {
+      int type = b / gear_lods, lod = b % gear_lods;
+      buckets[b] = gear_command(lod_mesh(field.mesh[type], lod), 0,
+                                field.first[type] * gear_lods + lod * field.count[type]);
+   }
+   std::vector<char> draws(gpu_draws_offset + sizeof(buckets));
+
+   glGenBuffers(1, &gpu_culling.visible);
+   glBindBuffer(GL_ARRAY_BUFFER, gpu_culling.visible);
+   glBufferData(GL_ARRAY_BUFFER, field.instances.size() * gear_lods * sizeof(animated_instance),
+                NULL, GL_DYNAMIC_COPY);
+   glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(animated_instance), (void *) 0);
+   glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(animated_instance), (void *) 16);
+
+   glGenBuffers(1, &gpu_culling.buckets);
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpu_culling.buckets);
+   glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(buckets), buckets, GL_DYNAMIC_COPY);
+
+   glGenBuffers(1, &gpu_culling.draws);
+   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gpu_culling.draws);
+   glBufferData(GL_DRAW_INDIRECT_BUFFER, draws.size(), draws.data(), GL_DYNAMIC_COPY);
+   if (GLEW_ARB_indirect_parameters)
+      glBindBuffer(GL_PARAMETER_BUFFER_ARB, gpu_culling.draws);
+
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, field.instance_buffer);
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, gpu_culling.visible);
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, gpu_culling.buckets);
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, gpu_culling.draws);
+}
+
+/*
+ * Objects shared by all contexts: the arena, the field's instances and
+ * the programs.
+ */
+static void
+init(void)
+{
+   /* make the gears */
+   gear1 = gear(1.0, 4.0, 1.0, 20, 0.7, 0.8, 0.1, 0.0);
+   gear2 = gear(0.5, 2.0, 2.0, 10, 0.7, 0.0, 0.8, 0.2);
+   gear3 = gear(1.3, 2.0, 0.5, 10, 0.7, 0.2, 0.2, 1.0);
+   scene_animation.resize(3);
+   scene_animation.set(0, -3.0, -2.0, 0.0, 1.0);
+   scene_animation.set(1, 3.1, -2.0, -9.0, -2.0);
+   scene_animation.set(2, -3.1, 4.2, -25.0, -2.0);
+   if (scene_file && !load_scene(scene_file))
+      exit(1);
+   if (pass_eyes == 2 && !GLEW_ARB_shader_viewport_layer_array &&
+       !GLEW_AMD_vertex_shader_layer) {
+      printf("single-pass stereo needs gl_Layer in vertex shaders, drawing the eyes in two passes\n");
+      pass_eyes = 1;
+   }
+   if (!procedural) {
+      generate_meshes();
+      startup_mark("gear meshes");
+      upload_arena();
+      startup_mark("mesh upload");
+   }
+   else if (printInfo) {
+      printf("procedural gears: no vertex or index buffers\n");
+   }
+
+   if (scene_file)
+      build_scene_field();
+   else if (field_gears > 0)
+      build_field(field_gears);
+   if (save_scene_file)
+      save_scene(save_scene_file);
+
+   std::string sceneShader = eye_shader(procedural ? procedural_vertex_shader().c_str() :
+                                        vertexShader);
+   shaderProgram = build_program(sceneShader.c_str(), fragmentShader);
+   mLocation = glGetUniformLocation(shaderProgram, "m");
+   colorLocation = glGetUniformLocation(shaderProgram, "color");
+   shapeLocation = glGetUniformLocation(shaderProgram, "shape");
+   teethLocation = glGetUniformLocation(shaderProgram, "teeth");
+   startup_mark("programs");
+
+   indirect = indirect && !procedural && GLEW_ARB_multi_draw_indirect &&
+              GLEW_ARB_shader_draw_parameters &&
+              GLEW_ARB_shader_storage_buffer_object;
+   if (indirect)
+      indirectProgram = build_program(eye_shader(indirectVertexShader).c_str(), fragmentShader);
+
+   if (gpu_cull && field_gears > 0) {
+      /* the compute shaders are GLSL 4.30, which the extensions alone don't give */
+      if (GLEW_VERSION_4_3 && GLEW_ARB_compute_shader &&
+          GLEW_ARB_shader_storage_buffer_object && GLEW_ARB_multi_draw_indirect) {
+         init_gpu_cull();
+      }
+      else {
+         printf("-gpucull needs OpenGL 4.3 compute shaders and multi-draw-indirect, "
+                "culling on the CPU\n");
+         gpu_cull = GL_FALSE;
+      }
+   }
+   else {
+      gpu_cull = GL_FALSE;
+   }
+
+   static GLfloat pos[4] = { 5.0, 5.0, 10.0 };
+   GLuint programs[3] = { shaderProgram, indirectProgram, field.program };
+   for (int i = 0; i < 3; i++) {
+      if (programs[i]) {
+         glUseProgram(programs[i]);
+         glUniform3fv(glGetUniformLocation(programs[i], "light_position"), 1, pos);
+      }
+   }
+
+   startup_mark("programs");
+
+   if (printInfo)
+      printf("programs: %d from cache, %d compiled in %.2f ms\n",
+             programs_cached, programs_compiled, program_seconds * 1000.0);
+}
+
+/*
+ * State of the current context: its own VAO over the shared arena (and
+ * the field's instance attributes, pointed at the frame ring every
+ * frame), frame ring and bindings.
+ */
+static void
+init_context(void)
+{
+   glEnable(GL_CULL_FACE);
+   glEnable(GL_DEPTH_TEST);
+
+   glGenVertexArrays(1, &vao);
+   glBindVertexArray(vao);
+   if (!procedural) {
+      bind_gear_vertices(arena.vbo);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.ibo);
+   }
+   if (field_gears > 0) {
+      /* with single-pass stereo each instance is drawn once per eye */
+      glEnableVertexAttribArray(3);
+      glVertexAttribDivisor(3, pass_eyes);
+      glEnableVertexAttribArray(4);
+      glVertexAttribDivisor(4, pass_eyes);
+   }
+
+   if (gpu_cull)
+      create_frame_ring(0, 0, 0, 0);
+   else if (field_gears > 0)
+      create_frame_ring(0, field_buckets, field.instances.size(), sizeof(animated_instance));
+   else
+      create_frame_ring(indirect ? scene_commands : 0, scene_commands, 0, 0);
+   if (gpu_cull)
+      init_gpu_cull_context();
+   else if (indirect)
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, ring.buffer);
+
+   if (field_gears > 0)
+      glUseProgram(field.program);
+   else
+      glUseProgram(indirect ? indirectProgram : shaderProgram);
+   if (capture_dir)
+      start_capture();
+
+   startup_mark("context state");
+}
+
+static void
+finish_context(void)
+{
+   if (capture_dir)
+      finish_capture();
+   glUseProgram(0);
+   glDeleteVertexArrays(1, &vao);
+   delete_frame_ring();
+   if (dynres_budget > 0.0)
+      delete_dynres_framebuffer();
+   if (stereo)
+      delete_stereo_framebuffer();
+   if (gpu_cull)
+      glDeleteBuffers(3, &gpu_culling.visible);
+   delete_flight_queue();
+   glDeleteQueries(gpu_query_count, gpu_timer.queries);
+}
+
+/**
+ * Remove window border/decorations.
+ */
+static void
+no_border( Display *dpy, Window w)
+{
+   static const unsigned MWM_HINTS_DECORATIONS = (1 << 1);
+   static const int PROP_MOTIF_WM_HINTS_ELEMENTS = 5;
+
+   typedef struct
+   {
+      unsigned long       flags;
+      unsigned long       functions;
+      unsigned long       decorations;
+      long                inputMode;
+      unsigned long       status;
+   } PropMotifWmHints;
+
+   PropMotifWmHints motif_hints;
    Atom prop, proptype;
    unsigned long flags = 0;
 
@@ -489,13 +4678,16 @@ no_border( Display *dpy, Window w)
 }
 
 
+static const long event_mask = StructureNotifyMask | ExposureMask | KeyPressMask;
+
 /*
  * Create an RGB, double-buffered window.
- * Return the window and context handles.
+ * Return the window and context handles.  The context shares objects with
+ * share, if not NULL.
  */
 static void
 make_window( Display *dpy, const char *name,
-             int x, int y, int width, int height,
+             int x, int y, int width, int height, GLXContext share,
              Window *winRet, GLXContext *ctxRet, VisualID *visRet)
 {
    int attribs[64];
@@ -505,8 +4697,8 @@ make_window( Display *dpy, const char *name,
    XSetWindowAttributes attr;
    unsigned long mask;
    Window root;
-   Window win;
-   GLXContext ctx;
+   Window win = None;
+   GLXContext ctx = NULL;
    XVisualInfo *visinfo;
 
    /* Singleton attributes. */
@@ -537,6 +4729,7 @@ make_window( Display *dpy, const char *name,
    root = RootWindow( dpy, scrnum );
 
    visinfo = glXChooseVisual(dpy, scrnum, attribs);
+   startup_mark("glXChooseVisual");
    if (!visinfo) {
       printf("Error: couldn't get an RGB, Double-buffered");
       if (stereo)
@@ -547,45 +4740,254 @@ make_window( Display *dpy, const char *name,
       exit(1);
    }
 
-   /* window attributes */
-   attr.background_pixel = 0;
-   attr.border_pixel = 0;
-   attr.colormap = XCreateColormap( dpy, root, visinfo->visual, AllocNone);
-   attr.event_mask = StructureNotifyMask | ExposureMask | KeyPressMask;
-   /* XXX this is a bad way to get a borderless window! */
-   mask = CWBackPixel | CWBorderPixel | CWColormap | CWEventMask;
+   /* window attributes */
+   attr.background_pixel = 0;
+   attr.border_pixel = 0;
+   attr.colormap = XCreateColormap( dpy, root, visinfo->visual, AllocNone);
+   attr.event_mask = event_mask;
+   /* XXX this is a bad way to get a borderless window! */
+   mask = CWBackPixel | CWBorderPixel | CWColormap | CWEventMask;
+
+   win = XCreateWindow( dpy, root, x, y, width, height,
+                        0, visinfo->depth, InputOutput,
+                        visinfo->visual, mask, &attr );
+
+   if (fullscreen)
+      no_border(dpy, win);
+
+   /* set hints and properties */
+   {
+      XSizeHints sizehints;
+      sizehints.x = x;
+      sizehints.y = y;
+      sizehints.width  = width;
+      sizehints.height = height;
+      sizehints.flags = USSize | USPosition;
+      XSetNormalHints(dpy, win, &sizehints);
+      XSetStandardProperties(dpy, win, name, name,
+                              None, (char **)NULL, 0, &sizehints);
+   }
+
+   startup_mark("XCreateWindow");
+
+   ctx = glXCreateContext( dpy, visinfo, share, True );
+   if (!ctx) {
+      printf("Error: glXCreateContext failed\n");
+      exit(1);
+   }
+   startup_mark("glXCreateContext");
+
+   *winRet = win;
+   *ctxRet = ctx;
+   *visRet = visinfo->visualid;
+
+   XFree(visinfo);
+}
+
+
+/*
+ * Headless rendering (-offscreen).  The context comes from EGL, surfaceless
+ * where EGL_MESA_platform_surfaceless / EGL_KHR_surfaceless_context allow
+ * it and with a 1x1 pbuffer otherwise.  Without EGL a GLX pbuffer is used,
+ * which still needs an X display.  Either way draw_gears() renders into an
+ * FBO of the requested size.
+ */
+static int
+is_egl_extension_supported(EGLDisplay dpy, const char *query)
+{
+   const char *extensions = eglQueryString(dpy, EGL_EXTENSIONS);
+   const size_t len = strlen(query);
+   const char *ptr = extensions ? strstr(extensions, query) : NULL;
+   return ((ptr != NULL) && ((ptr[len] == ' ') || (ptr[len] == '\0')));
+}
+
+static GLboolean
+make_egl_context(void)
+{
+   EGLDisplay dpy = EGL_NO_DISPLAY;
+
+   if (is_egl_extension_supported(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless")) {
+      PFNEGLGETPLATFORMDISPLAYEXTPROC pGetPlatformDisplay =
+         (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+      if (pGetPlatformDisplay)
+         dpy = pGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+   }
+   if (dpy == EGL_NO_DISPLAY)
+      dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+   if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, NULL, NULL))
+      return GL_FALSE;
+
+   static const EGLint config_attribs[] = {
+      EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_RED_SIZE, 1,
+      EGL_GREEN_SIZE, 1,
+      EGL_BLUE_SIZE, 1,
+      EGL_NONE
+   };
+   EGLConfig config;
+   EGLint count;
+   if (!eglBindAPI(EGL_OPENGL_API) ||
+       !eglChooseConfig(dpy, config_attribs, &config, 1, &count) || count == 0) {
+      eglTerminate(dpy);
+      return GL_FALSE;
+   }
+
+   EGLContext ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, NULL);
+   if (ctx == EGL_NO_CONTEXT) {
+      eglTerminate(dpy);
+      return GL_FALSE;
+   }
+
+   EGLSurface surface = EGL_NO_SURFACE;
+   if (!is_egl_extension_supported(dpy, "EGL_KHR_surfaceless_context")) {
+      static const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+      surface = eglCreatePbufferSurface(dpy, config, pbuffer_attribs);
+   }
+   if (!eglMakeCurrent(dpy, surface, surface, ctx)) {
+      eglDestroyContext(dpy, ctx);
+      eglTerminate(dpy);
+      return GL_FALSE;
+   }
+
+   target.egl_dpy = dpy;
+   target.egl_config = config;
+   target.egl_ctx = ctx;
+   target.egl_surface = surface;
+   return GL_TRUE;
+}
+
+static GLboolean
+make_glx_pbuffer_context(const char *dpyName)
+{
+   Display *dpy = XOpenDisplay(dpyName);
+   if (!dpy)
+      return GL_FALSE;
+
+   static const int config_attribs[] = {
+      GLX_DRAWABLE_TYPE, GLX_PBUFFER_BIT,
+      GLX_RENDER_TYPE, GLX_RGBA_BIT,
+      GLX_RED_SIZE, 1,
+      GLX_GREEN_SIZE, 1,
+      GLX_BLUE_SIZE, 1,
+      None
+   };
+   int count;
+   GLXFBConfig *configs = glXChooseFBConfig(dpy, DefaultScreen(dpy), config_attribs, &count);
+   if (!configs || count == 0) {
+      XCloseDisplay(dpy);
+      return GL_FALSE;
+   }
+
+   static const int pbuffer_attribs[] = { GLX_PBUFFER_WIDTH, 1, GLX_PBUFFER_HEIGHT, 1, None };
+   target.pbuffer = glXCreatePbuffer(dpy, configs[0], pbuffer_attribs);
+   target.ctx = glXCreateNewContext(dpy, configs[0], GLX_RGBA_TYPE, NULL, True);
+   target.config = configs[0];
+   XFree(configs);
+   if (!target.ctx || !glXMakeContextCurrent(dpy, target.pbuffer, target.pbuffer, target.ctx)) {
+      XCloseDisplay(dpy);
+      return GL_FALSE;
+   }
+
+   target.dpy = dpy;
+   return GL_TRUE;
+}
+
+static GLboolean
+make_offscreen_context(const char *dpyName)
+{
+   if (make_egl_context())
+      return GL_TRUE;
+   return make_glx_pbuffer_context(dpyName);
+}
+
+static void
+destroy_offscreen_context(void)
+{
+   if (target.egl_dpy) {
+      eglMakeCurrent(target.egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+      if (target.egl_surface != EGL_NO_SURFACE)
+         eglDestroySurface(target.egl_dpy, target.egl_surface);
+      eglDestroyContext(target.egl_dpy, target.egl_ctx);
+      eglTerminate(target.egl_dpy);
+   }
+   else {
+      glXMakeContextCurrent(target.dpy, None, None, NULL);
+      glXDestroyContext(target.dpy, target.ctx);
+      glXDestroyPbuffer(target.dpy, target.pbuffer);
+      XCloseDisplay(target.dpy);
+   }
+}
+
+/*
+ * Another context on the same display sharing objects with shared, for
+ * -windows.  It gets its own pbuffer where one is needed, since a surface
+ * can only be current in one thread.
+ */
+static GLboolean
+make_shared_offscreen_context(const offscreen_target &shared, offscreen_target &t)
+{
+   t = shared;
+   if (shared.egl_dpy) {
+      if (shared.egl_surface != EGL_NO_SURFACE) {
+         static const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+         t.egl_surface = eglCreatePbufferSurface(shared.egl_dpy, shared.egl_config, pbuffer_attribs);
+      }
+      t.egl_ctx = eglCreateContext(shared.egl_dpy, shared.egl_config, shared.egl_ctx, NULL);
+      return t.egl_ctx != EGL_NO_CONTEXT;
+   }
+
+   static const int pbuffer_attribs[] = { GLX_PBUFFER_WIDTH, 1, GLX_PBUFFER_HEIGHT, 1, None };
+   t.pbuffer = glXCreatePbuffer(shared.dpy, shared.config, pbuffer_attribs);
+   t.ctx = glXCreateNewContext(shared.dpy, shared.config, GLX_RGBA_TYPE, shared.ctx, True);
+   return t.ctx != NULL;
+}
 
-   win = XCreateWindow( dpy, root, x, y, width, height,
-                        0, visinfo->depth, InputOutput,
-                        visinfo->visual, mask, &attr );
+static void
+destroy_shared_offscreen_context(const offscreen_target &t)
+{
+   if (t.egl_dpy) {
+      if (t.egl_surface != EGL_NO_SURFACE)
+         eglDestroySurface(t.egl_dpy, t.egl_surface);
+      eglDestroyContext(t.egl_dpy, t.egl_ctx);
+   }
+   else {
+      glXDestroyContext(t.dpy, t.ctx);
+      glXDestroyPbuffer(t.dpy, t.pbuffer);
+   }
+}
 
-   if (fullscreen)
-      no_border(dpy, win);
+/* Color and depth renderbuffers of the requested size, multisampled with -samples. */
+static void
+create_offscreen_framebuffer(int width, int height)
+{
+   target.width = width;
+   target.height = height;
 
-   /* set hints and properties */
-   {
-      XSizeHints sizehints;
-      sizehints.x = x;
-      sizehints.y = y;
-      sizehints.width  = width;
-      sizehints.height = height;
-      sizehints.flags = USSize | USPosition;
-      XSetNormalHints(dpy, win, &sizehints);
-      XSetStandardProperties(dpy, win, name, name,
-                              None, (char **)NULL, 0, &sizehints);
-   }
+   glGenRenderbuffers(1, &target.color);
+   glBindRenderbuffer(GL_RENDERBUFFER, target.color);
+   glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+   glGenRenderbuffers(1, &target.depth);
+   glBindRenderbuffer(GL_RENDERBUFFER, target.depth);
+   glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
 
-   ctx = glXCreateContext( dpy, visinfo, NULL, True );
-   if (!ctx) {
-      printf("Error: glXCreateContext failed\n");
+   glGenFramebuffers(1, &target.fbo);
+   glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.color);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depth);
+   if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      printf("Error: incomplete offscreen framebuffer\n");
       exit(1);
    }
+}
 
-   *winRet = win;
-   *ctxRet = ctx;
-   *visRet = visinfo->visualid;
-
-   XFree(visinfo);
+static void
+delete_offscreen_framebuffer(void)
+{
+   glBindFramebuffer(GL_FRAMEBUFFER, 0);
+   glDeleteFramebuffers(1, &target.fbo);
+   glDeleteRenderbuffers(1, &target.color);
+   glDeleteRenderbuffers(1, &target.depth);
 }
 
 
@@ -612,7 +5014,7 @@ is_glx_extension_supported(Display *dpy, const char *query)
 /**
  * Attempt to determine whether or not the display is synched to vblank.
  */
-static void
+static int
 query_vsync(Display *dpy, GLXDrawable drawable)
 {
    int interval = 0;
@@ -651,6 +5053,8 @@ query_vsync(Display *dpy, GLXDrawable drawable)
                 interval);
       }
    }
+
+   return interval;
 }
 
 /**
@@ -704,23 +5108,391 @@ handle_event(Display *dpy, Window win, XEvent *event)
 }
 
 
+/*
+ * Fetch the next event of win, waiting for one if wait is set.  Render
+ * threads share the display connection, so with several windows each one
+ * only takes its own events (and polls, to notice when another one quits).
+ */
+static GLboolean
+next_event(Display *dpy, Window win, XEvent *event, GLboolean wait)
+{
+   if (num_windows == 1) {
+      if (!wait && XPending(dpy) == 0)
+         return GL_FALSE;
+      XNextEvent(dpy, event);
+      return GL_TRUE;
+   }
+
+   while (!XCheckWindowEvent(dpy, win, event_mask, event)) {
+      if (!wait || quit)
+         return GL_FALSE;
+      usleep(10000);
+   }
+   return GL_TRUE;
+}
+
 static void
 event_loop(Display *dpy, Window win)
 {
-   while (1) {
+   double t0 = current_time();
+
+   while (!quit) {
       int op;
-      while (!animate || XPending(dpy) > 0) {
-         XEvent event;
-         XNextEvent(dpy, &event);
+      XEvent event;
+      while (next_event(dpy, win, &event, !animate)) {
          op = handle_event(dpy, win, &event);
-         if (op == EXIT)
+         if (op == EXIT) {
+            quit = true;
             return;
+         }
          else if (op == DRAW)
             break;
       }
+      if (quit)
+         return;
+
+      draw_frame(dpy, win);
+      if (max_frames > 0 && frames_drawn >= max_frames)
+         return;
+      if (run_seconds > 0.0 && current_time() - t0 >= run_seconds)
+         return;
+   }
+}
+
+/* event_loop() for -fps: sleep until an event arrives or a frame is due. */
+static void
+paced_event_loop(Display *dpy, Window win)
+{
+   /* With several windows the connection wakes every thread for every
+    * event, so they only sleep on their timer. */
+   int fd = num_windows == 1 ? ConnectionNumber(dpy) : -1;
+   double t0 = current_time();
+
+   start_pacer();
+   while (!quit) {
+      GLboolean draw = GL_FALSE;
+      XEvent event;
+      while (next_event(dpy, win, &event, GL_FALSE)) {
+         int op = handle_event(dpy, win, &event);
+         if (op == EXIT)
+            quit = true;
+         else if (op == DRAW && !animate)
+            draw = GL_TRUE;
+      }
+      if (quit)
+         break;
+      if (!draw) {
+         /* woken by an event, or paused: back to the events */
+         if (!wait_pacer(fd, animate) || !animate)
+            continue;
+      }
 
       draw_frame(dpy, win);
+      if (max_frames > 0 && frames_drawn >= max_frames)
+         break;
+      if (run_seconds > 0.0 && current_time() - t0 >= run_seconds)
+         break;
+   }
+   stop_pacer();
+}
+
+
+/* Draw frames into the offscreen target until max_frames are drawn or
+ * run_seconds have passed. */
+static void
+offscreen_loop(void)
+{
+   double t0 = current_time(), t;
+   int frames = 0;
+
+   if (target_fps > 0)
+      start_pacer();
+   do {
+      if (target_fps > 0)
+         wait_pacer(-1, GL_TRUE);
+      draw_frame(NULL, None);
+      frames++;
+      t = current_time();
+   } while (max_frames > 0 ? frames_drawn < max_frames : t - t0 < run_seconds);
+   if (target_fps > 0)
+      stop_pacer();
+
+   glFinish();
+   t = current_time() - t0;
+   std::lock_guard<std::mutex> lock(intervals_mutex);
+   if (num_windows > 1)
+      printf("window %d: ", window_index);
+   printf("offscreen %dx%d: %d frames in %3.1f seconds = %6.3f FPS\n",
+          target.width, target.height, frames, t, frames / t);
+}
+
+
+/*
+ * -windows N: one render thread per window (or offscreen context), all
+ * submitting at once.  The contexts are created up front by the main
+ * thread, sharing with the first, and each thread sets up its own context
+ * state, runs the usual loop and tears its state down again.
+ */
+struct render_window {
+   Window win;
+   GLXContext ctx;
+   offscreen_target target;             /* with -offscreen */
+   int frames;
+   double seconds;
+};
+
+static void
+render_thread(Display *dpy, int index, render_window *w, int width, int height)
+{
+   window_index = index;
+   if (offscreen) {
+      target = w->target;
+      if (target.egl_dpy)
+         eglMakeCurrent(target.egl_dpy, target.egl_surface, target.egl_surface, target.egl_ctx);
+      else
+         glXMakeContextCurrent(target.dpy, target.pbuffer, target.pbuffer, target.ctx);
+   }
+   else {
+      glXMakeCurrent(dpy, w->win, w->ctx);
+   }
+
+   init_context();
+   if (offscreen)
+      create_offscreen_framebuffer(width, height);
+   reshape(width, height);
+   startup_mark("framebuffer");
+
+   double t0 = current_time();
+   if (offscreen)
+      offscreen_loop();
+   else if (target_fps > 0)
+      paced_event_loop(dpy, w->win);
+   else
+      event_loop(dpy, w->win);
+   finish_intervals();
+   w->frames = frames_drawn;
+   w->seconds = current_time() - t0;
+
+   finish_context();
+   if (offscreen) {
+      delete_offscreen_framebuffer();
+      if (target.egl_dpy) {
+         eglMakeCurrent(target.egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+         eglReleaseThread();
+      }
+      else {
+         glXMakeContextCurrent(target.dpy, None, None, NULL);
+      }
+   }
+   else {
+      glXMakeCurrent(dpy, None, NULL);
+   }
+}
+
+static void
+run_windows(Display *dpy, std::vector<render_window> &windows, int width, int height)
+{
+   std::vector<std::thread> threads;
+   for (int i = 0; i < num_windows; i++)
+      threads.push_back(std::thread(render_thread, dpy, i, &windows[i], width, height));
+   for (std::thread &thread : threads)
+      thread.join();
+
+   int frames = 0;
+   double fps = 0.0;
+   for (int i = 0; i < num_windows; i++) {
+      const render_window &w = windows[i];
+      printf("window %d: %d frames in %3.1f seconds = %6.3f FPS\n", i, w.frames,
+             w.seconds, w.frames / w.seconds);
+      frames += w.frames;
+      fps += w.frames / w.seconds;
+   }
+   printf("total: %d frames in %d windows = %6.3f FPS\n", frames, num_windows, fps);
+
+   /* for the report */
+   frames_drawn = frames;
+   win_width = width;
+   win_height = height;
+}
+
+
+/*
+ * Structured results (-report FILE).  JSON holds the run description and
+ * an array of intervals; CSV has one row per interval with the run
+ * description repeated in every row, which is what spreadsheet and
+ * dashboard importers want.
+ */
+static void
+json_string(FILE *f, const char *str)
+{
+   fputc('"', f);
+   for (const char *p = str ? str : ""; *p; p++) {
+      if (*p == '"' || *p == '\\')
+         fprintf(f, "\\%c", *p);
+      else if ((unsigned char) *p < 0x20)
+         fprintf(f, "\\u%04x", *p);
+      else
+         fputc(*p, f);
+   }
+   fputc('"', f);
+}
+
+static void
+json_time_stats(FILE *f, const char *name, const time_stats &stats)
+{
+   fprintf(f, "\"%s\": {\"count\": %zu, \"min\": %.4f, \"p50\": %.4f, "
+           "\"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}", name, stats.count,
+           stats.min, stats.p50, stats.p95, stats.p99, stats.max);
+}
+
+static void
+write_json_report(FILE *f, VisualID visId)
+{
+   fprintf(f, "{\n  \"renderer\": ");
+   json_string(f, (const char *) glGetString(GL_RENDERER));
+   fprintf(f, ",\n  \"version\": ");
+   json_string(f, (const char *) glGetString(GL_VERSION));
+   fprintf(f, ",\n  \"vendor\": ");
+   json_string(f, (const char *) glGetString(GL_VENDOR));
+   if (offscreen)
+      fprintf(f, ",\n  \"visual_id\": null");
+   else
+      fprintf(f, ",\n  \"visual_id\": %d", (int) visId);
+   if (swap_interval < 0)
+      fprintf(f, ",\n  \"swap_interval\": null");
+   else
+      fprintf(f, ",\n  \"swap_interval\": %d", swap_interval);
+   fprintf(f, ",\n  \"width\": %d,\n  \"height\": %d,\n  \"samples\": %d",
+           win_width, win_height, samples);
+   fprintf(f, ",\n  \"offscreen\": %s,\n  \"stereo\": %s,\n  \"single_pass_stereo\": %s,"
+           "\n  \"stereo_samples\": %d,\n  \"windows\": %d",
+           offscreen ? "true" : "false", stereo ? "true" : "false",
+           pass_eyes == 2 ? "true" : "false", stereo_samples, num_windows);
+   std::string capture_name = capture_dir ? std::string("\"") + capture_format_names[capture_fmt] + "\""
+                                          : "null";
+   fprintf(f, ",\n  \"scene\": {\"file\": ");
+   if (scene_file)
+      json_string(f, scene_file);
+   else
+      fprintf(f, "null");
+   fprintf(f, ", \"gears\": %d, \"packed\": %s, \"indirect\": %s, "
+           "\"fixed_step\": %s, \"frames_in_flight\": %d, \"fps\": %d, \"lod\": %s, "
+           "\"lod_bias\": %.3f, \"cull\": %s, \"gpu_cull\": %s, "
+           "\"procedural\": %s, \"dynres_ms\": %.3f, \"dynres_samples\": %d, "
+           "\"capture\": %s, \"frames\": %d}",
+           field_gears > 0 ? field_gears : 3, packed ? "true" : "false",
+           indirect ? "true" : "false", fixed_step ? "true" : "false",
+           frames_in_flight, target_fps, use_lod ? "true" : "false", lod_bias,
+           use_cull ? "true" : "false", gpu_cull ? "true" : "false",
+           procedural ? "true" : "false", dynres_budget, dynres_samples,
+           capture_name.c_str(), frames_drawn);
+   fprintf(f, ",\n  \"programs\": {\"cached\": %d, \"compiled\": %d, \"ms\": %.4f}",
+           programs_cached, programs_compiled, program_seconds * 1000.0);
+   fprintf(f, ",\n  \"startup_ms\": {");
+   for (size_t i = 0; i < startup_phases.size(); i++) {
+      fprintf(f, "%s", i ? ", " : "");
+      json_string(f, startup_phases[i].name);
+      fprintf(f, ": %.4f", startup_phases[i].seconds * 1000.0);
+   }
+   fprintf(f, "}");
+   fprintf(f, ",\n  \"intervals\": [");
+   for (size_t i = 0; i < intervals.size(); i++) {
+      const interval_record &r = intervals[i];
+      fprintf(f, "%s\n    {\"window\": %d, \"frames\": %d, \"seconds\": %.4f, \"fps\": %.4f, ",
+              i ? "," : "", r.window, r.frames, r.seconds, r.fps);
+      json_time_stats(f, "cpu_ms", r.cpu);
+      fprintf(f, ", ");
+      json_time_stats(f, "gpu_ms", r.gpu);
+      fprintf(f, ", ");
+      json_time_stats(f, "latency_ms", r.latency);
+      fprintf(f, ", ");
+      json_time_stats(f, "cpu_use_ms", r.cpu_use);
+      fprintf(f, ", ");
+      json_time_stats(f, "jitter_ms", r.jitter);
+      fprintf(f, ", ");
+      json_time_stats(f, "scale_pct", r.scale);
+      fprintf(f, ", ");
+      json_time_stats(f, "capture_ms", r.capture);
+      fprintf(f, ", \"gpu_dropped\": %d, \"missed\": %d", r.gpu_dropped, r.missed);
+      fprintf(f, ", \"lod\": {\"gears\": [%.2f, %.2f, %.2f], \"triangles\": %.1f, "
+              "\"full_triangles\": %.1f}", r.lod.gears[0], r.lod.gears[1], r.lod.gears[2],
+              r.lod.triangles, r.lod.full_triangles);
+      fprintf(f, ", \"cull\": {\"visible\": %.2f, \"culled\": %.2f}}",
+              r.cull.visible, r.cull.culled);
+   }
+   fprintf(f, "\n  ]\n}\n");
+}
+
+static void
+csv_string(FILE *f, const char *str)
+{
+   fputc('"', f);
+   for (const char *p = str ? str : ""; *p; p++) {
+      if (*p == '"')
+         fputc('"', f);
+      fputc(*p, f);
    }
+   fputc('"', f);
+}
+
+static void
+write_csv_report(FILE *f, VisualID visId)
+{
+   fprintf(f, "renderer,version,vendor,visual_id,swap_interval,width,height,samples,"
+           "offscreen,stereo,single_pass_stereo,stereo_samples,windows,gears,packed,indirect,fixed_step,frames_in_flight,target_fps,lod,lod_bias,cull,gpu_cull,procedural,dynres_ms,dynres_samples,capture,window,interval,frames,seconds,fps,"
+           "cpu_count,cpu_min,cpu_p50,cpu_p95,cpu_p99,cpu_max,"
+           "gpu_count,gpu_min,gpu_p50,gpu_p95,gpu_p99,gpu_max,"
+           "latency_count,latency_min,latency_p50,latency_p95,latency_p99,latency_max,"
+           "cpu_use_count,cpu_use_min,cpu_use_p50,cpu_use_p95,cpu_use_p99,cpu_use_max,"
+           "jitter_count,jitter_min,jitter_p50,jitter_p95,jitter_p99,jitter_max,"
+           "scale_count,scale_min,scale_p50,scale_p95,scale_p99,scale_max,"
+           "capture_count,capture_min,capture_p50,capture_p95,capture_p99,capture_max,"
+           "gpu_dropped,missed,lod0_gears,lod1_gears,lod2_gears,triangles,full_triangles,"
+           "visible,culled,scene\n");
+   for (size_t i = 0; i < intervals.size(); i++) {
+      const interval_record &r = intervals[i];
+      csv_string(f, (const char *) glGetString(GL_RENDERER));
+      fputc(',', f);
+      csv_string(f, (const char *) glGetString(GL_VERSION));
+      fputc(',', f);
+      csv_string(f, (const char *) glGetString(GL_VENDOR));
+      fprintf(f, ",%s,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%.3f,%d,%d,%d,%.3f,%d,%s,%d,%zu,%d,%.4f,%.4f",
+              offscreen ? "" : std::to_string((int) visId).c_str(),
+              swap_interval < 0 ? "" : std::to_string(swap_interval).c_str(),
+              win_width, win_height, samples, offscreen, stereo, pass_eyes == 2, stereo_samples,
+              num_windows,
+              field_gears > 0 ? field_gears : 3, packed, indirect, fixed_step,
+              frames_in_flight, target_fps, use_lod, lod_bias, use_cull, gpu_cull, procedural, dynres_budget,
+              dynres_samples, capture_dir ? capture_format_names[capture_fmt] : "", r.window,
+              i, r.frames,
+              r.seconds, r.fps);
+      const time_stats *stats[7] = { &r.cpu, &r.gpu, &r.latency, &r.cpu_use, &r.jitter,
+                                     &r.scale, &r.capture };
+      for (int j = 0; j < 7; j++)
+         fprintf(f, ",%zu,%.4f,%.4f,%.4f,%.4f,%.4f", stats[j]->count, stats[j]->min,
+                 stats[j]->p50, stats[j]->p95, stats[j]->p99, stats[j]->max);
+      fprintf(f, ",%d,%d,%.2f,%.2f,%.2f,%.1f,%.1f,%.2f,%.2f,", r.gpu_dropped, r.missed,
+              r.lod.gears[0], r.lod.gears[1], r.lod.gears[2], r.lod.triangles,
+              r.lod.full_triangles, r.cull.visible, r.cull.culled);
+      csv_string(f, scene_file);
+      fputc('\n', f);
+   }
+}
+
+static void
+write_report(const char *path, VisualID visId)
+{
+   FILE *f = fopen(path, "w");
+   if (!f) {
+      printf("Error: couldn't write %s\n", path);
+      return;
+   }
+   size_t len = strlen(path);
+   if (len > 4 && strcmp(path + len - 4, ".csv") == 0)
+      write_csv_report(f, visId);
+   else
+      write_json_report(f, visId);
+   fclose(f);
 }
 
 
@@ -730,10 +5502,44 @@ usage(void)
    printf("Usage:\n");
    printf("  -display <displayname>  set the display to run on\n");
    printf("  -stereo                 run in stereo mode\n");
+   printf("  -twopass                draw the stereo eyes in two passes, not one\n");
    printf("  -samples N              run in multisample mode with at least N samples\n");
    printf("  -fullscreen             run in fullscreen mode\n");
+   printf("  -packed                 use the packed 10:10:10:2 normal vertex layout\n");
+   printf("  -gears N                draw an instanced field of N meshing gears\n");
+   printf("  -scene FILE             draw the gear field described in FILE (text or binary)\n");
+   printf("  -save-scene FILE        write the gear field to FILE as a binary scene\n");
+   printf("  -noindirect             draw gear by gear instead of with multi-draw-indirect\n");
+   printf("  -dynres MS              scale the render resolution to hold a render cost of MS ms\n");
+   printf("  -procedural             build gear vertices in the vertex shader, without buffers\n");
+   printf("  -gpucull                cull the -gears field in a compute shader\n");
+   printf("  -nocull                 draw gears outside the view frustum too\n");
+   printf("  -nolod                  always draw gears at full detail\n");
+   printf("  -lod-bias F             scale projected gear sizes by F when picking the level of detail\n");
+   printf("  -genbench N             check and time gear mesh generation with N teeth and exit\n");
+   printf("  -threads N              run mesh generation and field animation on N threads (default: one per core)\n");
    printf("  -info                   display OpenGL renderer info\n");
    printf("  -geometry WxH+X+Y       window geometry\n");
+   printf("  -offscreen              render WxH into an FBO without a window (EGL)\n");
+   printf("  -seconds N              stop after N seconds (offscreen default 10)\n");
+   printf("  -frames N               stop after N frames\n");
+   printf("  -fixed-step             advance the animation by a fixed step per frame\n");
+   printf("  -startup-profile        time each startup phase up to the first frame\n");
+   printf("  -cache-dir DIR          keep programs and meshes in DIR (default ~/.cache/glxgears)\n");
+   printf("  -noprogramcache         always compile programs from source\n");
+   printf("  -nomeshcache            always generate gear meshes\n");
+   printf("  -fps N                  draw N frames per second, sleeping in between\n");
+   printf("  -frames-in-flight N     wait for the GPU when N frames are queued (1-%d)\n",
+          max_frames_in_flight);
+   printf("  -windows N              render N windows (or contexts), one thread each\n");
+   printf("  -golden DIR             compare frames with (or record) DIR/frameNNNNN.ppm\n");
+   printf("  -golden-record          write the checkpoint frames to the -golden DIR instead\n");
+   printf("  -checkpoints N,M,...    frames to compare (default: the last of -frames)\n");
+   printf("  -min-psnr DB            lowest PSNR that passes (default 40)\n");
+   printf("  -capture DIR            write every frame to DIR without stalling rendering\n");
+   printf("  -capture-format F       ppm (DIR/frameNNNNN.ppm, default), raw (DIR/capture.rgb)\n");
+   printf("                          or y4m (DIR/capture.y4m)\n");
+   printf("  -report FILE            write results as JSON, or CSV if FILE ends in .csv\n");
 }
  
 
@@ -742,12 +5548,12 @@ main(int argc, char *argv[])
 {
    unsigned int winWidth = 300, winHeight = 300;
    int x = 0, y = 0;
-   Display *dpy;
-   Window win;
-   GLXContext ctx;
+   Display *dpy = NULL;
+   Window win = None;
+   GLXContext ctx = NULL;
    char *dpyName = NULL;
-   GLboolean printInfo = GL_FALSE;
-   VisualID visId;
+   VisualID visId = 0;
+   GLint genbench_teeth = 0;
    int i;
 
    for (i = 1; i < argc; i++) {
@@ -761,6 +5567,9 @@ main(int argc, char *argv[])
       else if (strcmp(argv[i], "-stereo") == 0) {
          stereo = GL_TRUE;
       }
+      else if (strcmp(argv[i], "-twopass") == 0) {
+         two_pass_stereo = GL_TRUE;
+      }
       else if (i < argc-1 && strcmp(argv[i], "-samples") == 0) {
          samples = strtod(argv[i+1], NULL );
          ++i;
@@ -768,6 +5577,146 @@ main(int argc, char *argv[])
       else if (strcmp(argv[i], "-fullscreen") == 0) {
          fullscreen = GL_TRUE;
       }
+      else if (strcmp(argv[i], "-packed") == 0) {
+         packed = GL_TRUE;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-gears") == 0) {
+         field_gears = atoi(argv[i+1]);
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-scene") == 0) {
+         scene_file = argv[i+1];
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-save-scene") == 0) {
+         save_scene_file = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-noindirect") == 0) {
+         indirect = GL_FALSE;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-dynres") == 0) {
+         dynres_budget = strtod(argv[i+1], NULL);
+         i++;
+      }
+      else if (strcmp(argv[i], "-procedural") == 0) {
+         procedural = GL_TRUE;
+      }
+      else if (strcmp(argv[i], "-gpucull") == 0) {
+         gpu_cull = GL_TRUE;
+      }
+      else if (strcmp(argv[i], "-nocull") == 0) {
+         use_cull = GL_FALSE;
+      }
+      else if (strcmp(argv[i], "-nolod") == 0) {
+         use_lod = GL_FALSE;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-lod-bias") == 0) {
+         lod_bias = strtod(argv[i+1], NULL);
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-genbench") == 0) {
+         genbench_teeth = atoi(argv[i+1]);
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-threads") == 0) {
+         pool_threads = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "-offscreen") == 0) {
+         offscreen = GL_TRUE;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-seconds") == 0) {
+         run_seconds = strtod(argv[i+1], NULL);
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-frames") == 0) {
+         max_frames = atoi(argv[i+1]);
+         i++;
+      }
+      else if (strcmp(argv[i], "-fixed-step") == 0) {
+         fixed_step = GL_TRUE;
+      }
+      else if (strcmp(argv[i], "-startup-profile") == 0) {
+         startup_profile = GL_TRUE;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-cache-dir") == 0) {
+         cache_dir = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-noprogramcache") == 0) {
+         program_cache = GL_FALSE;
+      }
+      else if (strcmp(argv[i], "-nomeshcache") == 0) {
+         mesh_cache = GL_FALSE;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-fps") == 0) {
+         target_fps = atoi(argv[i+1]);
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-frames-in-flight") == 0) {
+         frames_in_flight = atoi(argv[i+1]);
+         if (frames_in_flight < 0)
+            frames_in_flight = 0;
+         else if (frames_in_flight > max_frames_in_flight)
+            frames_in_flight = max_frames_in_flight;
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-windows") == 0) {
+         num_windows = atoi(argv[i+1]);
+         if (num_windows < 1)
+            num_windows = 1;
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-golden") == 0) {
+         golden_dir = argv[i+1];
+         i++;
+      }
+      else if (strcmp(argv[i], "-golden-record") == 0) {
+         golden_record = GL_TRUE;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-checkpoints") == 0) {
+         char *p = argv[i+1], *end;
+         for (;;) {
+            long frame = strtol(p, &end, 10);
+            if (end == p || frame < 1 || frame > INT_MAX || num_checkpoints == max_checkpoints ||
+                (*end != ',' && *end != '\0')) {
+               printf("Error: -checkpoints wants up to %d frame numbers, not %s\n",
+                      max_checkpoints, argv[i+1]);
+               return -1;
+            }
+            checkpoints[num_checkpoints++] = frame;
+            if (*end == '\0')
+               break;
+            p = end + 1;
+         }
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-capture") == 0) {
+         capture_dir = argv[i+1];
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-capture-format") == 0) {
+         int f;
+         for (f = 0; f < 3; f++) {
+            if (strcmp(argv[i+1], capture_format_names[f]) == 0)
+               break;
+         }
+         if (f == 3) {
+            usage();
+            return -1;
+         }
+         capture_fmt = (capture_format) f;
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-report") == 0) {
+         report_file = argv[i+1];
+         i++;
+      }
+      else if (i < argc-1 && strcmp(argv[i], "-min-psnr") == 0) {
+         min_psnr = strtod(argv[i+1], NULL);
+         i++;
+      }
       else if (i < argc-1 && strcmp(argv[i], "-geometry") == 0) {
          XParseGeometry(argv[i+1], &x, &y, &winWidth, &winHeight);
          i++;
@@ -778,59 +5727,233 @@ main(int argc, char *argv[])
       }
    }
 
-   dpy = XOpenDisplay(dpyName);
-   if (!dpy) {
-      printf("Error: couldn't open display %s\n",
-             dpyName ? dpyName : getenv("DISPLAY"));
+   if (genbench_teeth > 0) {
+      return gear_generation_benchmark(genbench_teeth) ? 0 : 1;
+   }
+
+   if (startup_profile)
+      start_startup_profile();
+
+   if (dynres_budget > 0.0) {
+      if (stereo) {
+         printf("Error: -dynres does not support -stereo\n");
+         return -1;
+      }
+      /* the window stays single-sampled; the scaled framebuffer is not */
+      dynres_samples = samples;
+      samples = 0;
+   }
+   if (stereo && !two_pass_stereo) {
+      /* likewise for the layered framebuffer of single-pass stereo */
+      pass_eyes = 2;
+      stereo_samples = samples;
+      samples = 0;
+   }
+
+   if (golden_record && !golden_dir) {
+      printf("Error: -golden-record needs -golden DIR\n");
+      return -1;
+   }
+   if (golden_dir) {
+      /* a run that compares nothing must not pass */
+      if (num_checkpoints == 0) {
+         if (max_frames <= 0) {
+            printf("Error: -golden needs -frames or -checkpoints\n");
+            return -1;
+         }
+         checkpoints[num_checkpoints++] = max_frames;
+      }
+      for (int c = 0; c < num_checkpoints; c++) {
+         if (max_frames > 0 && checkpoints[c] > max_frames) {
+            printf("Error: checkpoint %d is past -frames %d\n", checkpoints[c], max_frames);
+            return -1;
+         }
+      }
+   }
+
+   if (scene_file && field_gears > 0) {
+      printf("Error: -scene replaces the -gears field\n");
       return -1;
    }
+   if (save_scene_file && !scene_file && field_gears <= 0) {
+      printf("Error: -save-scene needs -gears or -scene\n");
+      return -1;
+   }
+
+   if (procedural) {
+      if (field_gears > 0 || scene_file) {
+         printf("Error: -procedural does not draw the -gears field\n");
+         return -1;
+      }
+      use_lod = GL_FALSE;               /* there are no coarser meshes */
+   }
 
-   if (fullscreen) {
-      int scrnum = DefaultScreen(dpy);
+   if (num_windows > 1) {
+      if (golden_dir) {
+         printf("Error: -golden needs a single window\n");
+         return -1;
+      }
+      if (capture_dir) {
+         printf("Error: -capture needs a single window\n");
+         return -1;
+      }
+      XInitThreads();
+   }
+   std::vector<render_window> windows(num_windows);
 
-      x = 0; y = 0;
-      winWidth = DisplayWidth(dpy, scrnum);
-      winHeight = DisplayHeight(dpy, scrnum);
+   if (offscreen) {
+      if (stereo) {
+         printf("Error: -stereo needs a window\n");
+         return -1;
+      }
+      if (!make_offscreen_context(dpyName)) {
+         printf("Error: couldn't create an EGL or GLX pbuffer context\n");
+         return -1;
+      }
+      startup_mark(target.egl_dpy ? "EGL context" : "GLX pbuffer context");
+      if (run_seconds <= 0.0 && max_frames <= 0)
+         run_seconds = 10.0;
+      windows[0].target = target;
+      for (i = 1; i < num_windows; i++) {
+         if (!make_shared_offscreen_context(target, windows[i].target)) {
+            printf("Error: couldn't create offscreen context %d\n", i);
+            return -1;
+         }
+      }
    }
+   else {
+      dpy = XOpenDisplay(dpyName);
+      if (!dpy) {
+         printf("Error: couldn't open display %s\n",
+                dpyName ? dpyName : getenv("DISPLAY"));
+         return -1;
+      }
+      startup_mark("XOpenDisplay");
 
-   make_window(dpy, "glxgears", x, y, winWidth, winHeight, &win, &ctx, &visId);
-   XMapWindow(dpy, win);
-   glXMakeCurrent(dpy, win, ctx);
-   query_vsync(dpy, win);
+      if (fullscreen) {
+         int scrnum = DefaultScreen(dpy);
+
+         x = 0; y = 0;
+         winWidth = DisplayWidth(dpy, scrnum);
+         winHeight = DisplayHeight(dpy, scrnum);
+      }
+
+      make_window(dpy, "glxgears", x, y, winWidth, winHeight, NULL, &win, &ctx, &visId);
+      windows[0].win = win;
+      windows[0].ctx = ctx;
+      for (i = 1; i < num_windows; i++) {
+         int wx = fullscreen ? 0 : x + i * (winWidth + 10);
+         make_window(dpy, "glxgears", wx, y, winWidth, winHeight, ctx,
+                     &windows[i].win, &windows[i].ctx, &visId);
+      }
+      for (i = 0; i < num_windows; i++)
+         XMapWindow(dpy, windows[i].win);
+      startup_mark("XMapWindow");
+      glXMakeCurrent(dpy, win, ctx);
+      swap_interval = query_vsync(dpy, win);
+      startup_mark("glXMakeCurrent");
+   }
 
    glewInit();
+   startup_mark("glewInit");
    if (printInfo) {
       printf("GL_RENDERER   = %s\n", (char *) glGetString(GL_RENDERER));
       printf("GL_VERSION    = %s\n", (char *) glGetString(GL_VERSION));
       printf("GL_VENDOR     = %s\n", (char *) glGetString(GL_VENDOR));
       printf("GL_EXTENSIONS = %s\n", (char *) glGetString(GL_EXTENSIONS));
-      printf("VisualID %d, 0x%x\n", (int) visId, (int) visId);
+      if (offscreen)
+         printf("Offscreen %s context\n", target.egl_dpy ? "EGL" : "GLX pbuffer");
+      else
+         printf("VisualID %d, 0x%x\n", (int) visId, (int) visId);
+      startup_mark("print info");
    }
 
    init();
 
-   /* Set initial projection/viewing transformation.
-    * We can't be sure we'll get a ConfigureNotify event when the window
-    * first appears.
-    */
-   reshape(winWidth, winHeight);
+   if (num_windows > 1) {
+      /* The render threads make the contexts current themselves. */
+      if (!offscreen)
+         glXMakeCurrent(dpy, None, NULL);
+      else if (target.egl_dpy)
+         eglMakeCurrent(target.egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+      else
+         glXMakeContextCurrent(target.dpy, None, None, NULL);
+
+      run_windows(dpy, windows, winWidth, winHeight);
+
+      if (!offscreen)
+         glXMakeCurrent(dpy, win, ctx);
+      else if (target.egl_dpy)
+         eglMakeCurrent(target.egl_dpy, target.egl_surface, target.egl_surface, target.egl_ctx);
+      else
+         glXMakeContextCurrent(target.dpy, target.pbuffer, target.pbuffer, target.ctx);
+      for (i = 1; i < num_windows; i++) {
+         if (offscreen) {
+            destroy_shared_offscreen_context(windows[i].target);
+         }
+         else {
+            glXDestroyContext(dpy, windows[i].ctx);
+            XDestroyWindow(dpy, windows[i].win);
+         }
+      }
+   }
+   else {
+      init_context();
+
+      /* Set initial projection/viewing transformation.
+       * We can't be sure we'll get a ConfigureNotify event when the window
+       * first appears.
+       */
+      if (offscreen)
+         create_offscreen_framebuffer(winWidth, winHeight);
+      reshape(winWidth, winHeight);
+      startup_mark("framebuffer");
+
+      if (offscreen)
+         offscreen_loop();
+      else if (target_fps > 0)
+         paced_event_loop(dpy, win);
+      else
+         event_loop(dpy, win);
 
-   event_loop(dpy, win);
+      finish_intervals();
+      finish_context();
+   }
 
-   glDeleteVertexArrays(1, &gear1.first);
-   glDeleteBuffers(1, &gear1.second);
-   glDeleteVertexArrays(1, &gear2.first);
-   glDeleteBuffers(1, &gear2.second);
-   glDeleteVertexArrays(1, &gear3.first);
-   glDeleteBuffers(1, &gear3.second);
+   if (report_file)
+      write_report(report_file, visId);
+
+   delete_arena();
+   stop_pool();
+   if (field_gears > 0)
+      glDeleteProgram(field.program);
+   if (gpu_cull) {
+      glDeleteBuffers(1, &field.instance_buffer);
+      glDeleteProgram(field.cull_program);
+      glDeleteProgram(field.compact_program);
+   }
+   if (indirect)
+      glDeleteProgram(indirectProgram);
 
-   glUseProgram(0);
    glDeleteProgram(shaderProgram);
 
-   glXMakeCurrent(dpy, None, NULL);
-   glXDestroyContext(dpy, ctx);
-   XDestroyWindow(dpy, win);
-   XCloseDisplay(dpy);
+   if (offscreen) {
+      if (num_windows == 1)
+         delete_offscreen_framebuffer();
+      destroy_offscreen_context();
+   }
+   else {
+      glXMakeCurrent(dpy, None, NULL);
+      glXDestroyContext(dpy, ctx);
+      XDestroyWindow(dpy, win);
+      XCloseDisplay(dpy);
+   }
 
+   if (golden_dir)
+      check_checkpoints_reached();
+   if (golden_failures > 0) {
+      printf("%d golden image check(s) failed\n", golden_failures);
+      return 1;
+   }
    return 0;
 }